@@ -0,0 +1,92 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fmt/core.h>
+
+#include "common.hpp"
+#include "file.hpp"
+#include "file_io.hpp"
+
+// Measures cache hits of FileCache::get_or_read from several threads at
+// once. Every thread looks up the same cached files in a different order,
+// so the threads keep meeting in the shards. The same lookups are run on a
+// cache with a single shard, which has one lock for the whole cache like
+// the cache before the sharding, and the results are printed side by side.
+
+static constexpr size_t FILE_COUNT = 64;
+static constexpr size_t FILE_SIZE = 4*1024;
+static constexpr size_t LOOKUPS_PER_THREAD = 1'000'000;
+
+static awaitable<void> look_up(FileCache& cache, const std::vector<std::string>& paths, size_t thread_index, size_t lookups) {
+    for (size_t i = 0; i < lookups; ++i) {
+        auto file = co_await cache.get_or_read(paths[(i*7 + thread_index) % paths.size()]);
+        if (!file) {
+            fmt::print(stderr, "Lookup failed\n");
+            std::exit(1);
+        }
+    }
+}
+
+// Runs the lookups of every thread on an io_context of its own, like the workers of the server
+static void run_lookups(FileCache& cache, const std::vector<std::string>& paths, size_t thread_count, size_t lookups) {
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            asio::io_context io_context(1);
+            asio::make_service<FileIo>(io_context, nullptr);
+            co_spawn(io_context, look_up(cache, paths, t, lookups), detached);
+            io_context.run();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+int main(int argc, char** argv) {
+    const size_t max_threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+
+    char folder_template[] = "/tmp/cache-bench-XXXXXX";
+    if (!mkdtemp(folder_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const std::filesystem::path folder = folder_template;
+
+    std::vector<std::string> paths;
+    const std::string contents(FILE_SIZE, 'x');
+    for (size_t i = 0; i < FILE_COUNT; ++i) {
+        const auto name = fmt::format("{}.html", i);
+        auto file = std::fopen((folder / name).c_str(), "wb");
+        std::fwrite(contents.data(), 1, contents.size(), file);
+        std::fclose(file);
+        paths.push_back("/" + name);
+    }
+
+    FileCache sharded_cache(folder.c_str());
+    FileCache single_lock_cache(folder.c_str(), FileCache::DEFAULT_MAX_CACHE_SIZE, nullptr, true, {}, 1);
+    // Every file is read once, so the measured lookups are all hits
+    run_lookups(sharded_cache, paths, 1, FILE_COUNT);
+    run_lookups(single_lock_cache, paths, 1, FILE_COUNT);
+
+    fmt::print("{} cached files, {} lookups per thread, ns per lookup per thread and M lookups/s in total\n", FILE_COUNT, LOOKUPS_PER_THREAD);
+    fmt::print("{:12}{:>23}{:>23}\n", "", fmt::format("{} shards", FileCache::SHARD_COUNT), "1 shard");
+    for (size_t thread_count = 1; thread_count <= std::max<size_t>(max_threads, 1); thread_count *= 2) {
+        const double total = (double)thread_count*LOOKUPS_PER_THREAD;
+        fmt::print("{:>3} threads:", thread_count);
+        for (auto* cache : { &sharded_cache, &single_lock_cache }) {
+            const auto start = std::chrono::steady_clock::now();
+            run_lookups(*cache, paths, thread_count, LOOKUPS_PER_THREAD);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            fmt::print("  {:7.1f} ns, {:6.2f} M/s", elapsed.count()*1e9*thread_count/total, total/elapsed.count()/1e6);
+        }
+        fmt::print("\n");
+    }
+
+    std::filesystem::remove_all(folder);
+    return 0;
+}
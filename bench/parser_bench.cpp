@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fmt/core.h>
+
+#include "common.hpp"
+#include "http.hpp"
+#include "scan.hpp"
+
+// Measures the request parser on the bytes already in its buffer, so no
+// socket is involved, and the scan kernel it uses against a byte-by-byte loop.
+
+static constexpr size_t PARSED_REQUESTS = 1'000'000;
+static constexpr size_t SCANNED_BYTES = 1ull*1024*1024*1024;
+
+// A request like a browser sends, with 17 headers
+static const std::string_view REQUEST =
+    "GET /assets/scripts/application.js?v=20231016 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/articles/2023/10/parsing-http-requests-quickly\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,fi;q=0.8\r\n"
+    "Cookie: session=6f1c2b0a9e8d7c6b5a4f3e2d1c0b9a8f; theme=dark; consent=necessary,analytics; _ga=GA1.2.1234567890.1697450000\r\n"
+    "If-None-Match: \"5f2a-18b3c4d5e6f70000-0123456789abcdef\"\r\n"
+    "If-Modified-Since: Mon, 16 Oct 2023 10:00:00 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_seconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void bench_parse() {
+    asio::io_context io_context;
+    asio::ip::tcp::socket socket(io_context);
+    HttpRequestParser parser(socket);
+    parser.b = std::move(*RingBufferPool::local().acquire(HttpRequestParser::MIN_BUFFER_LENGTH));
+    memcpy(&parser.b[0], REQUEST.data(), REQUEST.size());
+
+    size_t header_count = 0;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < PARSED_REQUESTS; ++i) {
+        parser.p = 0;
+        parser.end = REQUEST.size();
+        HttpRequest request;
+        if (parser.parse(request) != HttpRequestParser::ParseResult::DONE) {
+            fmt::print(stderr, "The request wasn't parsed\n");
+            return;
+        }
+        header_count += request.headers.size();
+    }
+    const auto seconds = elapsed_seconds(start);
+    fmt::print("parse: {:7.1f} ns per request of {} bytes with {} headers, {:5.2f} GB/s\n",
+        seconds*1e9/PARSED_REQUESTS, REQUEST.size(), header_count / PARSED_REQUESTS, REQUEST.size()*PARSED_REQUESTS / seconds / 1e9);
+}
+
+[[gnu::noinline]] static const char* scan_scalar(const char* p, const char* end) {
+    while (p < end && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+
+[[gnu::noinline]] static const char* scan_vector(const char* p, const char* end) {
+    return scan_for<'\r'>(p, end);
+}
+
+// Finds the ends of the header lines of the request, like the parser does
+template<class F> static void bench_scan(const char* name, F scan) {
+    const char* const begin = REQUEST.data();
+    const char* const end = begin + REQUEST.size();
+
+    size_t line_count = 0;
+    const auto start = Clock::now();
+    for (size_t scanned = 0; scanned < SCANNED_BYTES; scanned += REQUEST.size()) {
+        for (const char* p = begin; p < end; p += 2) {
+            p = scan(p, end);
+            ++line_count;
+        }
+    }
+    const auto seconds = elapsed_seconds(start);
+    fmt::print("{:>12}: {:5.2f} GB/s ({} lines)\n", name, SCANNED_BYTES / seconds / 1e9, line_count);
+}
+
+int main() {
+    bench_parse();
+    bench_scan("scalar loop", scan_scalar);
+#if defined(__AVX2__)
+    bench_scan("AVX2 scan", scan_vector);
+#elif defined(__SSE2__)
+    bench_scan("SSE2 scan", scan_vector);
+#else
+    bench_scan("scan", scan_vector);
+#endif
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <fmt/core.h>
+
+#include "common.hpp"
+#include "ring_buffer.hpp"
+
+// Measures creating ring buffers, reusing them through the pool, and copying
+// into them across the end of the buffer, like the request parser does.
+// Creating and copying are measured for both sources of the memory, the
+// memfd_create used on Linux and the shm_open used elsewhere.
+
+static constexpr size_t REQUEST_BUFFER_LENGTH = 16*1024;
+static constexpr size_t LARGE_BUFFER_LENGTH = 4*1024*1024;
+static constexpr size_t CYCLES = 20'000;
+static constexpr size_t COPY_LENGTH = 8*1024;
+static constexpr size_t COPIED_BYTES = 2ull*1024*1024*1024;
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_seconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static const char* source_name(RingBuffer::MemorySource source) {
+    switch (source) {
+        case RingBuffer::MemorySource::MEMFD: return "memfd_create";
+        case RingBuffer::MemorySource::SHM_OPEN: return "shm_open";
+    }
+    return "";
+}
+
+static void bench_create(RingBuffer::MemorySource source) {
+    const auto start = Clock::now();
+    for (size_t i = 0; i < CYCLES; ++i) {
+        auto buffer = RingBuffer::create(REQUEST_BUFFER_LENGTH, source);
+        if (!buffer) {
+            fmt::print(stderr, "create with {}: {}\n", source_name(source), buffer.error());
+            return;
+        }
+    }
+    fmt::print("{:>12} create and destroy: {:8.2f} us\n", source_name(source), elapsed_seconds(start)*1e6/CYCLES);
+}
+
+static void bench_pool() {
+    auto& pool = RingBufferPool::local();
+    const auto start = Clock::now();
+    for (size_t i = 0; i < CYCLES; ++i) {
+        auto buffer = pool.acquire(REQUEST_BUFFER_LENGTH);
+        if (!buffer) {
+            fmt::print(stderr, "acquire: {}\n", buffer.error());
+            return;
+        }
+        pool.release(std::move(*buffer));
+    }
+    fmt::print("pool acquire and release: {:8.2f} us\n", elapsed_seconds(start)*1e6/CYCLES);
+}
+
+// Copies blocks to consecutive positions, wrapping around the end of the buffer
+static void bench_access(size_t length, RingBuffer::MemorySource source) {
+    auto buffer = RingBuffer::create(length, source);
+    if (!buffer) {
+        fmt::print(stderr, "create with {}: {}\n", source_name(source), buffer.error());
+        return;
+    }
+    std::vector<char> block(COPY_LENGTH, 'x');
+
+    size_t position = 0;
+    const auto start = Clock::now();
+    for (size_t copied = 0; copied < COPIED_BYTES; copied += COPY_LENGTH) {
+        memcpy(&(*buffer)[position], block.data(), COPY_LENGTH);
+        position = buffer->normalized_index(position + COPY_LENGTH + 1);
+    }
+    // Keeps the copies from being optimized away
+    volatile char sink = (*buffer)[0];
+    (void)sink;
+    fmt::print("{:>12} {:>5} kB access: {:8.2f} GB/s\n", source_name(source), buffer->length / 1024, COPIED_BYTES / elapsed_seconds(start) / 1e9);
+}
+
+int main() {
+    using enum RingBuffer::MemorySource;
+#ifdef __linux__
+    constexpr RingBuffer::MemorySource sources[] = { MEMFD, SHM_OPEN };
+#else
+    constexpr RingBuffer::MemorySource sources[] = { SHM_OPEN };
+#endif
+
+    for (auto source : sources) {
+        bench_create(source);
+    }
+    bench_pool();
+    for (auto length : { REQUEST_BUFFER_LENGTH, LARGE_BUFFER_LENGTH }) {
+        for (auto source : sources) {
+            bench_access(length, source);
+        }
+    }
+    return 0;
+}
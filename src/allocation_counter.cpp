@@ -0,0 +1,48 @@
+#include "allocation_counter.hpp"
+
+#ifdef COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+static thread_local size_t count = 0;
+
+size_t allocation_count() {
+    return count;
+}
+
+void* operator new(size_t size) {
+    ++count;
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+
+#else
+
+size_t allocation_count() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "common.hpp"
+
+// With COUNT_ALLOCATIONS defined, the global operator new counts the
+// allocations made by each thread. Otherwise the count stays 0.
+size_t allocation_count();
@@ -0,0 +1,64 @@
+#include "blocking_pool.hpp"
+
+#include <algorithm>
+
+BlockingPool::BlockingPool(size_t thread_count, size_t max_queue_length) : max_queue_length(max_queue_length) {
+    counters.thread_count = thread_count;
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back([this] { work(); });
+    }
+}
+
+BlockingPool::~BlockingPool() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    queue_changed.notify_all();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+BlockingPool::Stats BlockingPool::stats() {
+    std::lock_guard lock(mutex);
+    auto ret = counters;
+    ret.queue_length = queue.size();
+    counters.max_queue_length = ret.queue_length;
+    return ret;
+}
+
+bool BlockingPool::push(std::unique_ptr<Task>& task) {
+    {
+        std::lock_guard lock(mutex);
+        if (threads.empty() || queue.size() >= max_queue_length) {
+            ++counters.rejected;
+            return false;
+        }
+        queue.push_back(std::move(task));
+        counters.max_queue_length = std::max(counters.max_queue_length, queue.size());
+    }
+    queue_changed.notify_one();
+    return true;
+}
+
+void BlockingPool::work() {
+    std::unique_lock lock(mutex);
+    while (true) {
+        queue_changed.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) return;
+
+        auto task = std::move(queue.front());
+        queue.pop_front();
+        ++counters.busy_threads;
+
+        lock.unlock();
+        task->run();
+        task.reset();
+        lock.lock();
+
+        --counters.busy_threads;
+        ++counters.completed;
+    }
+}
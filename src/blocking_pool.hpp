@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.hpp"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A bounded pool of threads for blocking calls, like file system calls on
+// systems without io_uring. A coroutine awaiting run is resumed on its own
+// executor once the call has returned on a pool thread. When the queue is
+// full, the call is made on the calling thread instead.
+struct BlockingPool {
+    static constexpr size_t DEFAULT_THREAD_COUNT = 4;
+    static constexpr size_t DEFAULT_MAX_QUEUE_LENGTH = 1024;
+
+    struct Stats {
+        size_t thread_count = 0;
+        size_t busy_threads = 0;
+        size_t queue_length = 0;
+        // The longest the queue has been since the previous call to stats
+        size_t max_queue_length = 0;
+        size_t completed = 0;
+        // Calls made on the calling thread, because the queue was full
+        size_t rejected = 0;
+    };
+
+    BlockingPool(size_t thread_count = DEFAULT_THREAD_COUNT, size_t max_queue_length = DEFAULT_MAX_QUEUE_LENGTH);
+    BlockingPool(const BlockingPool&) = delete;
+    ~BlockingPool();
+
+    template<class F>
+    awaitable<std::invoke_result_t<F&>> run(F f) {
+        using Result = std::invoke_result_t<F&>;
+
+        co_return co_await asio::async_initiate<decltype(use_awaitable), void(Result)>([this, &f](auto handler) {
+            // The tracked executor keeps the io_context running while the call is in the pool
+            auto executor = asio::prefer(asio::get_associated_executor(handler), asio::execution::outstanding_work.tracked);
+            auto task = [f = std::move(f), handler = std::move(handler), executor]() mutable {
+                asio::post(executor, [handler = std::move(handler), result = f()]() mutable {
+                    handler(std::move(result));
+                });
+            };
+
+            std::unique_ptr<Task> queued = std::make_unique<FunctionTask<decltype(task)>>(std::move(task));
+            if (!push(queued)) {
+                queued->run();
+            }
+        }, use_awaitable);
+    }
+
+    Stats stats();
+
+    private:
+    struct Task {
+        virtual void run() = 0;
+        virtual ~Task() = default;
+    };
+    template<class F> struct FunctionTask : Task {
+        F f;
+        explicit FunctionTask(F&& f) : f(std::move(f)) {}
+        void run() override { f(); }
+    };
+
+    // Takes the task, unless the queue is full
+    bool push(std::unique_ptr<Task>& task);
+    void work();
+
+    const size_t max_queue_length;
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+    std::deque<std::unique_ptr<Task>> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+    Stats counters;
+};
@@ -3,143 +3,365 @@
 #include <algorithm>
 #include <filesystem>
 #include <cstring>
+#include <cerrno>
 #include <cstdio>
+#include <fmt/format.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "file_io.hpp"
+#include "http.hpp"
+
+// Bounds the length of one read, so a large file doesn't occupy the kernel for too long at a time
+static constexpr size_t MAX_READ_SIZE = 16*1024*1024;
+
+static FileReadError file_io_error(int error) {
+    if (error == -ENOENT || error == -ENOTDIR) {
+        return FileReadError{ FileReadError::NOT_FOUND };
+    }
+    return FileReadError{ FileReadError::IO_ERROR, {}, strerror(-error) };
+}
 
-static const std::unordered_map<std::string_view, const char*> MIME_TYPES = {
-    { "txt", "text/plain" },
-    { "html", "text/html" },
-    { "htm", "text/html" },
-    { "js", "text/javacsript" },
-    { "css", "text/css" },
-    { "json", "application/json" },
-    { "jpeg", "image/jpeg" },
-    { "jpg", "image/jpeg" },
-    { "png", "image/png" },
-    { "svg", "image/svg+xml" },
-    { "webp", "image/webp", },
-    { "avif", "image/avif" },
+// A read-only mapping of a whole file. It stays valid after the file is
+// replaced by renaming another file over it, since the mapping keeps the old
+// inode alive. Truncating the file in place makes the pages past the new end
+// unreadable, and rewriting it changes the mapped bytes, so the mapping keeps
+// the file open to check on every cache hit whether that has happened.
+struct FileMapping {
+    void* address = MAP_FAILED;
+    size_t length = 0;
+    int fd = -1;
+    timespec last_write = {};
+
+    FileMapping(const FileMapping&) = delete;
+    FileMapping(void* address, size_t length, int fd, timespec last_write) : address(address), length(length), fd(fd), last_write(last_write) {}
+    ~FileMapping() {
+        if (address != MAP_FAILED) {
+            munmap(address, length);
+        }
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
 };
 
-static std::string_view get_mime_type(const std::filesystem::path& path) {
-    const auto extension_path = path.extension();
-    std::string_view extension = extension_path.native();
-    if (extension.size() == 0) return DEFAULT_MIME_TYPE;
-    if (extension[0] == '.') extension = extension.substr(1);
+bool File::changed_on_disk() const {
+    if (!mapping) return false;
+
+    struct stat st;
+    if (fstat(mapping->fd, &st)) return true;
+#ifdef __APPLE__
+    const auto& last_write = st.st_mtimespec;
+#else
+    const auto& last_write = st.st_mtim;
+#endif
+    return (u64)st.st_size != mapping->length
+        || last_write.tv_sec != mapping->last_write.tv_sec
+        || last_write.tv_nsec != mapping->last_write.tv_nsec;
+}
+
+// A 64-bit hash of the bytes, fast rather than strong. Four independent
+// lanes of multiplications hide their latency.
+static u64 hash_contents(std::span<const char> bytes) {
+    constexpr u64 K0 = 0x9e3779b97f4a7c15ull, K1 = 0xbf58476d1ce4e5b9ull;
+    u64 lanes[4] = { K0, K1, K0 ^ K1, bytes.size() };
+    auto mix = [](u64 h, u64 word) {
+        h = (h ^ word) * K1;
+        return h ^ (h >> 29);
+    };
+
+    const char* p = bytes.data();
+    const char* const end = p + bytes.size();
+    for (; end - p >= 32; p += 32) {
+        for (size_t i = 0; i < 4; ++i) {
+            u64 word;
+            memcpy(&word, p + 8*i, 8);
+            lanes[i] = mix(lanes[i], word);
+        }
+    }
+    u64 last = 0;
+    for (size_t shift = 0; p < end; ++p, shift += 8) {
+        if (shift == 64) {
+            lanes[0] = mix(lanes[0], last);
+            last = 0;
+            shift = 0;
+        }
+        last |= (u64)(u8)*p << shift;
+    }
 
-    auto search = MIME_TYPES.find(extension);
-    return search != MIME_TYPES.end() ? search->second : DEFAULT_MIME_TYPE;
+    u64 h = mix(lanes[0], last);
+    for (size_t i = 1; i < 4; ++i) {
+        h = mix(h, lanes[i]);
+    }
+    return mix(h, K0);
 }
 
-tl::expected<File, FileReadError> read_file_contents(const std::filesystem::path& path) {
-    std::error_code ec;
+static std::string make_etag(u64 size, std::chrono::system_clock::time_point last_write, std::optional<u64> content_hash = std::nullopt) {
+    const auto last_write_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(last_write.time_since_epoch()).count();
+    if (content_hash) {
+        return fmt::format("\"{:x}-{:x}-{:016x}\"", size, last_write_ns, *content_hash);
+    }
+    return fmt::format("\"{:x}-{:x}\"", size, last_write_ns);
+}
 
-    auto exists = std::filesystem::exists(path, ec);
-    if (ec) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, ec });
+static tl::expected<File, FileReadError> map_opened_file(int fd, File&& file, const FileIo::Stat& stat) {
+    const size_t size = stat.size;
+    // The mapping keeps its own descriptor, since the caller closes fd
+    const int mapping_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (mapping_fd == -1) {
+        return tl::unexpected(file_io_error(-errno));
     }
-    if (!exists) {
-        return tl::unexpected(FileReadError{ FileReadError::NOT_FOUND, ec });
+    auto address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+        const auto error = file_io_error(-errno);
+        ::close(mapping_fd);
+        return tl::unexpected(error);
     }
+    auto mapping = std::make_shared<const FileMapping>(address, size, mapping_fd, stat.last_write);
 
-    File ret;
+    // Start reading the file in, so the first send doesn't wait for every page in turn
+    madvise(address, size, MADV_WILLNEED);
 
-    ret.mime_type = get_mime_type(path);
+    file.contents = std::span(static_cast<const char*>(address), size);
+    file.storage = mapping;
+    file.mapping = std::move(mapping);
+    return std::move(file);
+}
 
-    ret.last_write = std::filesystem::last_write_time(path, ec);
-    if (ec) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, ec });
+static awaitable<tl::expected<File, FileReadError>> read_opened_file(FileIo& io, int fd, const std::filesystem::path& path, size_t max_size, size_t min_mapped_size) {
+    FileIo::Stat stat;
+    if (auto error = co_await io.stat(fd, stat); error < 0) {
+        co_return tl::unexpected(file_io_error(error));
     }
-
-    FILE *file = fopen(path.c_str(), "rb");
-    if (!file) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, ec, strerror(errno) });
+    if (!stat.is_regular_file) {
+        co_return tl::unexpected(FileReadError{ FileReadError::NOT_FOUND });
     }
 
-    if (fseek(file, 0, SEEK_END)) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, ec, strerror(errno) });
-    }
-    const auto ftell_result = ftell(file);
-    if (ftell_result < 0) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, ec, strerror(errno) });
+    File ret;
+
+    using namespace std::chrono;
+    ret.last_write = system_clock::time_point(duration_cast<system_clock::duration>(seconds(stat.last_write.tv_sec) + nanoseconds(stat.last_write.tv_nsec)));
+
+    if (stat.size > max_size) {
+        ret.uncached_path = path;
+        ret.etag = make_etag(stat.size, ret.last_write);
+        co_return ret;
     }
-    const size_t length = ftell_result;
-    if (fseek(file, 0, SEEK_SET)) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, ec, strerror(errno) });
+
+    if (stat.size >= min_mapped_size) {
+        co_return map_opened_file(fd, std::move(ret), stat);
     }
 
-    ret.contents.resize(length);
-    const auto read_bytes = fread(ret.contents.data(), 1, length, file);
-    if (read_bytes != length) {
-        return tl::unexpected(FileReadError{ FileReadError::IO_ERROR });
+    auto buffer = std::shared_ptr<char[]>(new char[stat.size]);
+    size_t read_bytes = 0;
+    while (read_bytes < stat.size) {
+        const auto length = std::min<size_t>(stat.size - read_bytes, MAX_READ_SIZE);
+        auto result = co_await io.read(fd, buffer.get() + read_bytes, length, read_bytes);
+        if (result == -EINTR) continue;
+        if (result < 0) {
+            co_return tl::unexpected(file_io_error(result));
+        }
+        if (result == 0) {
+            // The file was truncated after stat
+            break;
+        }
+        read_bytes += result;
     }
 
-    return ret;
+    ret.contents = std::span<const char>(buffer.get(), read_bytes);
+    ret.storage = std::move(buffer);
+    co_return ret;
 }
 
-FileCache::FileCache(const char* folder) {
-    file_root_path = (std::filesystem::current_path() / folder).lexically_normal();
+awaitable<tl::expected<File, FileReadError>> read_file_contents(const std::filesystem::path& path, size_t max_size, size_t min_mapped_size) {
+    auto& io = FileIo::of(co_await this_coro::executor);
+
+    auto fd = co_await io.open(path.c_str());
+    if (fd < 0) {
+        co_return tl::unexpected(file_io_error(fd));
+    }
+
+    auto result = co_await read_opened_file(io, fd, path, max_size, min_mapped_size);
+    co_await io.close(fd);
+
+    co_return result;
 }
 
-tl::expected<std::reference_wrapper<const File>, FileReadError> FileCache::get_or_read(const std::string& uri_path) {
-    auto path = get_filesystem_path_from_uri_path(uri_path);
-    if (!path) {
-        return tl::unexpected(path.error());
+tl::expected<std::string, std::string> read_startup_file(const char* path) {
+    auto file = std::fopen(path, "rb");
+    if (!file) {
+        return tl::unexpected(fmt::format("open {}: {}", path, strerror(errno)));
     }
+    defer { std::fclose(file); };
 
-    if (auto search = file_map.find(*path); search != file_map.end()) {
-        const auto& it = search->second;
-        const auto now = Clock::now();
+    std::string contents;
+    char chunk[16*1024];
+    while (auto length = std::fread(chunk, 1, sizeof(chunk), file)) {
+        contents.append(chunk, length);
+    }
+    if (std::ferror(file)) {
+        return tl::unexpected(fmt::format("read {}: {}", path, strerror(errno)));
+    }
+    return contents;
+}
 
-        if (now - it->last_accessed > MAX_ENTRY_LIFETIME) {
-            cache_size -= it->file.contents.size();
-            file_list.erase(it);
-            file_map.erase(search);
+FileCache::FileCache(const char* folder, size_t max_cache_size, BlockingPool* blocking_pool, bool map_files, MimeTypes&& mime_types, size_t shard_count) : max_cache_size(max_cache_size), map_files(map_files), blocking_pool(blocking_pool), mime_types(std::move(mime_types)), shard_count(std::clamp<size_t>(shard_count, 1, SHARD_COUNT)) {
+    file_root_path = (std::filesystem::current_path() / folder).lexically_normal();
+}
 
-            goto read_file;
-        }
+// Not done in the coroutine, whose frame would grow by the size of the buffer
+static std::string build_content_fields(const File& file, u16 status) {
+    HttpResponseHeader h;
+    h.status = status;
+    h.last_modified = file.last_write;
+    h.etag = file.etag;
+    if (status == 200) {
+        h.content_type = file.mime_type;
+        h.content_length = file.contents.size();
+        h.accept_ranges = true;
+    }
+    HeaderBuffer header;
+    h.build_content_fields(header);
+    return std::string(header.view());
+}
 
-        it->last_accessed = now;
+static FileCache::Result entry_result(const FileCache::Entry& entry) {
+    if (entry.status != FileReadError::OK) {
+        return tl::unexpected(FileReadError{ entry.status });
+    } else {
+        return entry.file;
+    }
+}
 
-        if (it != file_list.begin()) {
-            file_list.push_front(std::move(*it));
-            file_list.erase(it);
-            auto begin = file_list.begin();
-            file_map[begin->path] = begin;
+awaitable<FileCache::Result> FileCache::get_or_read(std::string_view uri_path) {
+    auto& shard = shard_for(uri_path);
+    if (auto cached = find(shard, uri_path)) {
+        // Checked without the lock of the shard, since it's a system call
+        if (!*cached || !(**cached)->changed_on_disk()) {
+            co_return *cached;
         }
+        erase_if_current(shard, uri_path, **cached);
+    }
 
-        return latest_file();
+    // weakly_canonical stats every component of the path
+    tl::expected<std::filesystem::path, FileReadError> path;
+    if (blocking_pool) {
+        path = co_await blocking_pool->run([&] { return get_filesystem_path_from_uri_path(uri_path); });
+    } else {
+        path = get_filesystem_path_from_uri_path(uri_path);
+    }
+    if (!path) {
+        co_return tl::unexpected(path.error());
     }
 
-read_file:
-    auto read_file = read_file_contents(*path);
+    // The file is read without holding the lock of the shard, so a slow
+    // read doesn't block the other threads from using it
+    const auto min_mapped_size = map_files ? MIN_MAPPED_FILE_SIZE : std::numeric_limits<size_t>::max();
+    auto read_file = co_await read_file_contents(*path, MAX_CACHED_FILE_SIZE, min_mapped_size);
     if (!read_file && read_file.error().type == FileReadError::IO_ERROR) {
-        return tl::unexpected(read_file.error());
+        co_return tl::unexpected(read_file.error());
+    }
+
+    if (read_file) {
+        auto extension = path->extension().native();
+        read_file->mime_type = mime_types.find(std::string_view(extension).substr(extension.empty() ? 0 : 1));
     }
 
-    if (read_file && read_file->contents.size() > MAX_CACHED_FILE_SIZE) {
-        return *read_file;
+    if (read_file && read_file->uncached_path) {
+        read_file->not_modified_header = build_content_fields(*read_file, 304);
+        co_return std::make_shared<const File>(std::move(*read_file));
     }
 
     Entry new_entry;
-    new_entry.path = *path;
+    new_entry.uri_path = uri_path;
     if (read_file) {
-        new_entry.file = std::move(*read_file);
+        // Hashing a large file would hold up the other connections for too long
+        const auto contents = read_file->contents;
+        u64 content_hash;
+        if (blocking_pool && contents.size() >= MIN_MAPPED_FILE_SIZE) {
+            content_hash = co_await blocking_pool->run([contents] { return hash_contents(contents); });
+        } else {
+            content_hash = hash_contents(contents);
+        }
+        read_file->etag = make_etag(contents.size(), read_file->last_write, content_hash);
+        read_file->header = build_content_fields(*read_file, 200);
+        read_file->not_modified_header = build_content_fields(*read_file, 304);
+
+        new_entry.file = std::make_shared<const File>(std::move(*read_file));
     } else {
         new_entry.status = read_file.error().type;
     }
     new_entry.last_accessed = Clock::now();
 
-    file_list.push_front(std::move(new_entry));
-    auto it = file_list.begin();
-    file_map[it->path] = it;
-
-    cache_size += it->file.contents.size();
+    auto result = insert(shard, std::move(new_entry));
     trim();
 
-    return latest_file();
+    co_return result;
+}
+
+FileCache::Shard& FileCache::shard_for(std::string_view uri_path) {
+    return shards[std::hash<std::string_view>{}(uri_path) % shard_count];
 }
 
-tl::expected<std::filesystem::path, FileReadError> FileCache::get_filesystem_path_from_uri_path(const std::string& uri_path) const {
+std::optional<FileCache::Result> FileCache::find(Shard& shard, std::string_view uri_path) {
+    std::lock_guard lock(shard.mutex);
+
+    auto search = shard.file_map.find(uri_path);
+    if (search == shard.file_map.end()) {
+        return std::nullopt;
+    }
+
+    auto it = search->second;
+    const auto now = Clock::now();
+
+    if (now - it->last_accessed > MAX_ENTRY_LIFETIME) {
+        erase(shard, it);
+        return std::nullopt;
+    }
+
+    it->last_accessed = now;
+    shard.file_list.splice(shard.file_list.begin(), shard.file_list, it);
+
+    return entry_result(*it);
+}
+
+FileCache::Result FileCache::insert(Shard& shard, Entry&& entry) {
+    std::lock_guard lock(shard.mutex);
+
+    // Another thread may have read the same file while we did
+    if (auto search = shard.file_map.find(entry.uri_path); search != shard.file_map.end()) {
+        erase(shard, search->second);
+    }
+
+    shard.file_list.push_front(std::move(entry));
+    auto it = shard.file_list.begin();
+    shard.file_map[it->uri_path] = it;
+
+    cache_size += it->size();
+    entry_count += 1;
+
+    return entry_result(*it);
+}
+
+void FileCache::erase_if_current(Shard& shard, std::string_view uri_path, const std::shared_ptr<const File>& file) {
+    std::lock_guard lock(shard.mutex);
+
+    // Another thread may have replaced the entry already
+    auto search = shard.file_map.find(uri_path);
+    if (search != shard.file_map.end() && search->second->file == file) {
+        erase(shard, search->second);
+    }
+}
+
+void FileCache::erase(Shard& shard, List::iterator it) {
+    cache_size -= it->size();
+    entry_count -= 1;
+    shard.file_map.erase(it->uri_path);
+    shard.file_list.erase(it);
+}
+
+tl::expected<std::filesystem::path, FileReadError> FileCache::get_filesystem_path_from_uri_path(std::string_view uri_path) const {
     std::error_code ec;
 
     if (uri_path.size() == 0 || uri_path[0] != '/') {
@@ -166,21 +388,20 @@ tl::expected<std::filesystem::path, FileReadError> FileCache::get_filesystem_pat
 }
 
 
-tl::expected<std::reference_wrapper<const File>, FileReadError> FileCache::latest_file() const {
-    assert(!file_list.empty());
-    auto& entry = file_list.front();
-    if (entry.status != FileReadError::OK) {
-        return tl::unexpected(FileReadError{ entry.status });
-    } else {
-        return entry.file;
-    }
-}
-
+// Evicts the least recently used entries of the shards in turn until the
+// cache fits in its budget
 void FileCache::trim() {
-    while (cache_size > MAX_CACHE_SIZE || file_list.size() > MAX_CACHE_ENTRIES) {
-        const auto& entry = file_list.back();
-        cache_size -= entry.file.contents.size();
-        file_map.erase(entry.path);
-        file_list.pop_back();
+    size_t empty_shards = 0;
+    while ((cache_size > max_cache_size || entry_count > MAX_CACHE_ENTRIES) && empty_shards < shard_count) {
+        auto& shard = shards[next_trimmed_shard++ % shard_count];
+        std::lock_guard lock(shard.mutex);
+
+        if (shard.file_list.empty()) {
+            ++empty_shards;
+            continue;
+        }
+        empty_shards = 0;
+
+        erase(shard, std::prev(shard.file_list.end()));
     }
 }
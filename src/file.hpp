@@ -9,14 +9,46 @@
 #include <string>
 #include <string_view>
 #include <functional>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <limits>
+#include <span>
 #include <tl/expected.hpp>
+#include "blocking_pool.hpp"
+#include "mime_types.hpp"
 
-const char DEFAULT_MIME_TYPE[] = "application/octet-stream";
+struct FileMapping;
 
 struct File {
-    std::vector<char> contents;
-    std::filesystem::file_time_type last_write;
+    // The bytes of the file, owned by storage. Large files are backed by a
+    // read-only mapping of the file, so the bytes sent are the pages of the
+    // page cache instead of a copy of them on the heap.
+    std::span<const char> contents;
+    std::shared_ptr<const void> storage;
+    // Set for a mapped file, whose bytes change if the file is truncated or
+    // rewritten in place
+    std::shared_ptr<const FileMapping> mapping;
+    std::chrono::system_clock::time_point last_write;
     std::string mime_type = DEFAULT_MIME_TYPE;
+    // A strong entity tag, with the quotes. It's made of the size, the last
+    // write time and, for cached files, a hash of the contents.
+    std::string etag;
+    // The status line and the content fields of a 200 response with the
+    // file, built when the file is cached
+    std::string header;
+    // The same for a 304 response, which only has the validators of the file
+    std::string not_modified_header;
+    // Set instead of contents for files too large to be read to memory.
+    // They are sent straight from the file system.
+    std::optional<std::filesystem::path> uncached_path;
+
+    // Whether a mapped file has a different size or last write time on disk
+    // than when it was mapped. A file replaced by renaming another one over
+    // it isn't changed, since the mapping still refers to the old file.
+    bool changed_on_disk() const;
 };
 
 struct FileReadError {
@@ -32,40 +64,78 @@ struct FileReadError {
     const char* message = nullptr;
 };
 
-tl::expected<File, FileReadError> read_file_contents(const std::filesystem::path& path);
+// Reads the file with the FileIo of the current executor. Files of at least
+// min_mapped_size bytes are mapped instead of read. The MIME type is left to
+// the caller.
+awaitable<tl::expected<File, FileReadError>> read_file_contents(
+    const std::filesystem::path& path,
+    size_t max_size = std::numeric_limits<size_t>::max(),
+    size_t min_mapped_size = std::numeric_limits<size_t>::max()
+);
 
-struct ReferenceWrappedPathHash {
-    size_t operator() (const std::reference_wrapper<const std::filesystem::path>& a) const {
-        return std::filesystem::hash_value(a);
-    }
-};
+// Reads a whole file synchronously, for the files read once at startup.
+// The error is a message naming the file.
+tl::expected<std::string, std::string> read_startup_file(const char* path);
 
+// Thread-safe LRU cache for the files. The entries are split into shards by
+// the hash of their path and every shard has its own lock, so lookups of
+// files in different shards don't contend. The shards share one memory budget.
+//
+// The entries are keyed by the URI path, so a cache hit doesn't touch the
+// file system. On a miss, the URI path is resolved to a file system path on
+// the blocking pool, if one is given.
 struct FileCache {
     using Clock = std::chrono::steady_clock;
     using Time = std::chrono::time_point<Clock>;
+    using Result = tl::expected<std::shared_ptr<const File>, FileReadError>;
     struct Entry {
-        std::filesystem::path path;
+        std::string uri_path;
         FileReadError::Type status = FileReadError::OK;
-        File file;
+        std::shared_ptr<const File> file;
         Time last_accessed;
+
+        size_t size() const { return file ? file->contents.size() : 0; }
     };
     using List = std::list<Entry>;
 
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        List file_list;
+        std::unordered_map<std::string_view, List::iterator> file_map;
+    };
+
     static constexpr size_t MEGABYTE = 1024*1024;
     static constexpr size_t MAX_CACHED_FILE_SIZE = 128*MEGABYTE;
-    static constexpr size_t MAX_CACHE_SIZE = 1024*MEGABYTE;
+    static constexpr size_t DEFAULT_MAX_CACHE_SIZE = 1024*MEGABYTE;
     static constexpr size_t MAX_CACHE_ENTRIES = 1024;
     static constexpr auto MAX_ENTRY_LIFETIME = std::chrono::minutes(5);
+    static constexpr size_t SHARD_COUNT = 16;
+    // Smaller files are copied to the heap, since a mapping costs at least a page
+    static constexpr size_t MIN_MAPPED_FILE_SIZE = 64*1024;
 
-    FileCache(const char* folder = "");
+    // The shard count is at most SHARD_COUNT. A single shard puts the whole cache behind one lock.
+    FileCache(const char* folder = "", size_t max_cache_size = DEFAULT_MAX_CACHE_SIZE, BlockingPool* blocking_pool = nullptr, bool map_files = true, MimeTypes&& mime_types = {}, size_t shard_count = SHARD_COUNT);
 
     std::filesystem::path file_root_path;
-    List file_list;
-    std::unordered_map<std::reference_wrapper<const std::filesystem::path>, List::iterator, ReferenceWrappedPathHash> file_map;
-    size_t cache_size = 0;
+    const size_t max_cache_size;
+    const bool map_files;
+    BlockingPool* const blocking_pool;
+    const MimeTypes mime_types;
+    const size_t shard_count;
+    std::array<Shard, SHARD_COUNT> shards;
+    std::atomic<size_t> cache_size = 0;
+    std::atomic<size_t> entry_count = 0;
+    std::atomic<size_t> next_trimmed_shard = 0;
 
-    tl::expected<std::reference_wrapper<const File>, FileReadError> get_or_read(const std::string& uri_path);
-    tl::expected<std::filesystem::path, FileReadError> get_filesystem_path_from_uri_path(const std::string& uri_path) const;
-    tl::expected<std::reference_wrapper<const File>, FileReadError> latest_file() const;
+    awaitable<Result> get_or_read(std::string_view uri_path);
+    tl::expected<std::filesystem::path, FileReadError> get_filesystem_path_from_uri_path(std::string_view uri_path) const;
     void trim();
+
+    private:
+    Shard& shard_for(std::string_view uri_path);
+    std::optional<Result> find(Shard& shard, std::string_view uri_path);
+    Result insert(Shard& shard, Entry&& entry);
+    void erase(Shard& shard, List::iterator it);
+    // Erases the entry of the path, if it still has the file
+    void erase_if_current(Shard& shard, std::string_view uri_path, const std::shared_ptr<const File>& file);
 };
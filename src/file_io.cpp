@@ -0,0 +1,401 @@
+#include "file_io.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <atomic>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+FileIo& FileIo::of(const asio::any_io_executor& executor) {
+    auto& context = asio::query(executor, asio::execution::context);
+    return asio::use_service<FileIo>(static_cast<asio::io_context&>(context));
+}
+
+template<class F>
+awaitable<int> FileIo::blocking(F f) {
+    if (!offload_pool) {
+        co_return f();
+    }
+    co_return co_await offload_pool->run(std::move(f));
+}
+
+#ifdef __linux__
+
+static constexpr unsigned RING_ENTRIES = 256;
+
+struct FileIo::Operation {
+    virtual void complete(int result) = 0;
+    virtual void destroy() = 0;
+    virtual ~Operation() = default;
+};
+
+template<class Handler>
+struct HandlerOperation : FileIo::Operation {
+    Handler handler;
+
+    explicit HandlerOperation(Handler&& handler) : handler(std::move(handler)) {}
+
+    void complete(int result) override {
+        auto executor = asio::get_associated_executor(handler);
+        asio::post(executor, [handler = std::move(handler), result]() mutable {
+            handler(result);
+        });
+        delete this;
+    }
+
+    void destroy() override {
+        delete this;
+    }
+};
+
+// The memory shared with the kernel
+struct FileIo::Ring {
+    io_uring_params params = {};
+
+    void* sq_pointer = MAP_FAILED;
+    size_t sq_size = 0;
+    void* cq_pointer = MAP_FAILED;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    u32* sq_head;
+    u32* sq_tail;
+    u32 sq_mask;
+    u32* sq_array;
+    u32* cq_head;
+    u32* cq_tail;
+    u32 cq_mask;
+    io_uring_cqe* cqes;
+
+    std::unordered_set<Operation*> operations;
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_pointer != MAP_FAILED && cq_pointer != sq_pointer) munmap(cq_pointer, cq_size);
+        if (sq_pointer != MAP_FAILED) munmap(sq_pointer, sq_size);
+    }
+
+    bool map(int ring_fd) {
+        const auto& p = params;
+        sq_size = p.sq_off.array + p.sq_entries*sizeof(u32);
+        cq_size = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+
+        sq_pointer = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_pointer == MAP_FAILED) return false;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_pointer = sq_pointer;
+        } else {
+            cq_pointer = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_pointer == MAP_FAILED) return false;
+        }
+
+        sqes_size = p.sq_entries*sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        auto sq = (char*)sq_pointer;
+        sq_head = (u32*)(sq + p.sq_off.head);
+        sq_tail = (u32*)(sq + p.sq_off.tail);
+        sq_mask = *(u32*)(sq + p.sq_off.ring_mask);
+        sq_array = (u32*)(sq + p.sq_off.array);
+
+        auto cq = (char*)cq_pointer;
+        cq_head = (u32*)(cq + p.cq_off.head);
+        cq_tail = (u32*)(cq + p.cq_off.tail);
+        cq_mask = *(u32*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+        return true;
+    }
+
+    u32 unsubmitted() const {
+        return *sq_tail - std::atomic_ref(*sq_head).load(std::memory_order_acquire);
+    }
+};
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, const void* arg, unsigned arg_count) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, arg_count);
+}
+
+// The operations FileIo submits. Kernels 5.1 to 5.5 have io_uring without
+// some of them, and fail them with -EINVAL.
+static constexpr u8 USED_OPCODES[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+
+// Whether the kernel supports every operation in USED_OPCODES. Kernels
+// before 5.6 can't be probed, and don't support them all anyway.
+static bool supports_used_operations(int ring_fd) {
+    constexpr size_t PROBED_OP_COUNT = 256;
+    alignas(io_uring_probe) char buffer[sizeof(io_uring_probe) + PROBED_OP_COUNT*sizeof(io_uring_probe_op)] = {};
+    auto probe = (io_uring_probe*)buffer;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, PROBED_OP_COUNT)) return false;
+
+    for (auto opcode : USED_OPCODES) {
+        if (opcode > probe->last_op || opcode >= probe->ops_len || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+FileIo::FileIo(asio::execution_context& context, BlockingPool* offload_pool) : asio::io_context::service(static_cast<asio::io_context&>(context)), offload_pool(offload_pool), completion_event(static_cast<asio::io_context&>(context)) {
+    auto new_ring = std::make_unique<Ring>();
+
+    int fd = io_uring_setup(RING_ENTRIES, &new_ring->params);
+    if (fd == -1) return;
+
+    int event_fd = -1;
+    if (!supports_used_operations(fd)
+        || !new_ring->map(fd)
+        || (event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+        || io_uring_register(fd, IORING_REGISTER_EVENTFD, &event_fd, 1)) {
+        if (event_fd != -1) ::close(event_fd);
+        ::close(fd);
+        return;
+    }
+
+    boost::system::error_code ec;
+    completion_event.assign(event_fd, ec);
+    if (ec) {
+        ::close(event_fd);
+        ::close(fd);
+        return;
+    }
+
+    ring_fd = fd;
+    ring = std::move(new_ring);
+}
+
+FileIo::~FileIo() {
+    shutdown();
+}
+
+void FileIo::shutdown() {
+    boost::system::error_code ec;
+    completion_event.close(ec);
+
+    if (ring_fd != -1) {
+        ::close(ring_fd);
+        ring_fd = -1;
+    }
+    if (ring) {
+        for (auto operation : ring->operations) {
+            operation->destroy();
+        }
+        ring.reset();
+    }
+}
+
+struct FileIo::Request {
+    u8 opcode;
+    int fd = -1;
+    const char* path = nullptr;
+    void* buffer = nullptr;
+    u32 length = 0;
+    u64 offset = 0;
+};
+
+static int perform_synchronously(const FileIo::Request& request) {
+    int result = -1;
+    switch (request.opcode) {
+        case IORING_OP_OPENAT:
+            result = ::open(request.path, O_RDONLY | O_CLOEXEC);
+            break;
+        case IORING_OP_STATX:
+            result = statx(request.fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_SIZE | STATX_MTIME, (struct statx*)request.buffer);
+            break;
+        case IORING_OP_READ:
+            result = pread(request.fd, request.buffer, request.length, request.offset);
+            break;
+        case IORING_OP_CLOSE:
+            result = ::close(request.fd);
+            break;
+    }
+    return result < 0 ? -errno : result;
+}
+
+awaitable<int> FileIo::submit(const Request& request) {
+    // Keeping the operations in flight below the size of the completion queue makes sure no completion is lost
+    if (!ring || in_flight >= ring->params.cq_entries || ring->unsubmitted() >= ring->params.sq_entries) {
+        co_return co_await blocking([&request] { return perform_synchronously(request); });
+    }
+
+    co_return co_await asio::async_initiate<decltype(use_awaitable), void(int)>([this, &request](auto handler) {
+        auto operation = new HandlerOperation<decltype(handler)>(std::move(handler));
+        ring->operations.insert(operation);
+
+        auto tail = *ring->sq_tail;
+        auto index = tail & ring->sq_mask;
+        auto& sqe = ring->sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = request.opcode;
+        sqe.fd = request.fd;
+        sqe.addr = (u64)(request.path ? (const void*)request.path : request.buffer);
+        sqe.len = request.length;
+        sqe.off = request.offset;
+        sqe.user_data = (u64)operation;
+        switch (request.opcode) {
+            case IORING_OP_OPENAT:
+                sqe.fd = AT_FDCWD;
+                sqe.open_flags = O_RDONLY | O_CLOEXEC;
+                break;
+            case IORING_OP_STATX:
+                sqe.addr = (u64)"";
+                sqe.statx_flags = AT_EMPTY_PATH;
+                sqe.len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+                sqe.off = (u64)request.buffer;
+                break;
+        }
+        ring->sq_array[index] = index;
+        std::atomic_ref(*ring->sq_tail).store(tail + 1, std::memory_order_release);
+
+        ++in_flight;
+        submit_pending();
+        wait_for_completions();
+    }, use_awaitable);
+}
+
+void FileIo::submit_pending() {
+    const auto to_submit = ring->unsubmitted();
+    if (!to_submit || io_uring_enter(ring_fd, to_submit) >= 0) return;
+    const int error = errno;
+
+    // When the kernel is short of memory or its completion queue is full,
+    // the submissions are retried when the next completion arrives. That's
+    // only certain to happen while operations submitted before are in flight.
+    if ((error == EAGAIN || error == EBUSY || error == EINTR) && in_flight > to_submit) return;
+
+    // The kernel hasn't taken any of the entries, so they are taken back and
+    // their operations failed. Without SQPOLL, the kernel only reads the
+    // submission queue in io_uring_enter.
+    const auto head = std::atomic_ref(*ring->sq_head).load(std::memory_order_acquire);
+    for (auto i = head; i != *ring->sq_tail; ++i) {
+        auto operation = (Operation*)ring->sqes[ring->sq_array[i & ring->sq_mask]].user_data;
+        ring->operations.erase(operation);
+        --in_flight;
+        operation->complete(-error);
+    }
+    std::atomic_ref(*ring->sq_tail).store(head, std::memory_order_release);
+}
+
+void FileIo::wait_for_completions() {
+    if (waiting_for_completions || !in_flight) return;
+    waiting_for_completions = true;
+
+    completion_event.async_read_some(asio::buffer(&completion_event_count, sizeof(completion_event_count)), [this](const boost::system::error_code& ec, size_t) {
+        if (ec == asio::error::operation_aborted) return;
+        waiting_for_completions = false;
+
+        reap_completions();
+        if (ring) {
+            submit_pending();
+        }
+        wait_for_completions();
+    });
+}
+
+void FileIo::reap_completions() {
+    if (!ring) return;
+
+    auto head = *ring->cq_head;
+    auto tail = std::atomic_ref(*ring->cq_tail).load(std::memory_order_acquire);
+    while (head != tail) {
+        const auto& cqe = ring->cqes[head & ring->cq_mask];
+        auto operation = (Operation*)cqe.user_data;
+        auto result = cqe.res;
+        ++head;
+
+        ring->operations.erase(operation);
+        --in_flight;
+        operation->complete(result);
+    }
+    std::atomic_ref(*ring->cq_head).store(head, std::memory_order_release);
+}
+
+awaitable<int> FileIo::open(const char* path) {
+    co_return co_await submit({ .opcode = IORING_OP_OPENAT, .path = path });
+}
+
+awaitable<int> FileIo::stat(int fd, Stat& stat) {
+    struct statx buffer;
+    auto result = co_await submit({ .opcode = IORING_OP_STATX, .fd = fd, .buffer = &buffer });
+    if (result < 0) co_return result;
+
+    stat.is_regular_file = S_ISREG(buffer.stx_mode);
+    stat.size = buffer.stx_size;
+    stat.last_write = { buffer.stx_mtime.tv_sec, buffer.stx_mtime.tv_nsec };
+    co_return 0;
+}
+
+awaitable<int> FileIo::read(int fd, char* buffer, u32 length, u64 offset) {
+    co_return co_await submit({ .opcode = IORING_OP_READ, .fd = fd, .buffer = buffer, .length = length, .offset = offset });
+}
+
+awaitable<int> FileIo::close(int fd) {
+    co_return co_await submit({ .opcode = IORING_OP_CLOSE, .fd = fd });
+}
+
+#else
+
+struct FileIo::Operation {};
+struct FileIo::Ring {};
+
+FileIo::FileIo(asio::execution_context& context, BlockingPool* offload_pool) : asio::io_context::service(static_cast<asio::io_context&>(context)), offload_pool(offload_pool), completion_event(static_cast<asio::io_context&>(context)) {}
+
+FileIo::~FileIo() {}
+
+void FileIo::shutdown() {}
+
+static int syscall_result(int result) {
+    return result < 0 ? -errno : result;
+}
+
+awaitable<int> FileIo::open(const char* path) {
+    co_return co_await blocking([path] { return syscall_result(::open(path, O_RDONLY | O_CLOEXEC)); });
+}
+
+awaitable<int> FileIo::stat(int fd, Stat& stat) {
+    struct ::stat buffer;
+    auto result = co_await blocking([fd, &buffer] { return syscall_result(fstat(fd, &buffer)); });
+    if (result < 0) co_return result;
+
+    stat.is_regular_file = S_ISREG(buffer.st_mode);
+    stat.size = buffer.st_size;
+#ifdef __APPLE__
+    stat.last_write = buffer.st_mtimespec;
+#else
+    stat.last_write = buffer.st_mtim;
+#endif
+    co_return 0;
+}
+
+awaitable<int> FileIo::read(int fd, char* buffer, u32 length, u64 offset) {
+    co_return co_await blocking([=] { return syscall_result(pread(fd, buffer, length, offset)); });
+}
+
+awaitable<int> FileIo::close(int fd) {
+    co_return co_await blocking([fd] { return syscall_result(::close(fd)); });
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.hpp"
+#include <ctime>
+#include <memory>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include "blocking_pool.hpp"
+
+// Asynchronous file operations for the coroutines running on an io_context.
+// On Linux the operations are submitted to an io_uring, whose completions are
+// signaled through an eventfd waited on by the io_context, so the event loop
+// never blocks on the file system. Elsewhere, or if the kernel doesn't allow
+// io_uring, the operations are done on the threads of the offload pool given
+// with asio::make_service, or synchronously if there's no pool.
+//
+// The operations return the result of the corresponding system call, with
+// errors as negated errno values.
+struct FileIo : asio::io_context::service {
+    static inline asio::io_context::id id;
+
+    struct Stat {
+        bool is_regular_file = false;
+        u64 size = 0;
+        timespec last_write = {};
+    };
+
+    // The context must be an io_context
+    explicit FileIo(asio::execution_context& context, BlockingPool* offload_pool = nullptr);
+    FileIo(const FileIo&) = delete;
+    ~FileIo();
+
+    // The FileIo of the io_context running the executor
+    static FileIo& of(const asio::any_io_executor& executor);
+
+    awaitable<int> open(const char* path);
+    awaitable<int> stat(int fd, Stat& stat);
+    awaitable<int> read(int fd, char* buffer, u32 length, u64 offset);
+    awaitable<int> close(int fd);
+
+    bool uses_io_uring() const { return ring_fd != -1; }
+
+    struct Operation;
+    struct Ring;
+    struct Request;
+
+    private:
+    void shutdown() override;
+
+    awaitable<int> submit(const Request& request);
+    // Submits the entries in the submission queue. If the kernel doesn't
+    // take them and no completion is coming to retry with, their operations
+    // fail with the error.
+    void submit_pending();
+    void wait_for_completions();
+    void reap_completions();
+
+    template<class F> awaitable<int> blocking(F f);
+
+    BlockingPool* offload_pool;
+    int ring_fd = -1;
+    std::unique_ptr<Ring> ring;
+    asio::posix::stream_descriptor completion_event;
+    u64 completion_event_count = 0;
+    bool waiting_for_completions = false;
+    size_t in_flight = 0;
+};
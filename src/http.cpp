@@ -1,365 +1,934 @@
 #include "http.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <cstddef>
+#include <cstring>
 #include <limits>
-#include <map>
 #include <string_view>
 #include <optional>
+#include <ctime>
 #include <fmt/format.h>
-#include "ring_buffer.hpp"
+#include "perfect_hash.hpp"
+#include "scan.hpp"
 
 static const char HTTP_VERSION_1_1[] = "HTTP/1.1";
 
-static const std::unordered_map<u16, std::string_view> STATUS_REASON_PHRASES = {
-    { 100, "Continue" },
-    { 101, "Switching Protocols" },
-    { 102, "Processing" },
-    { 103, "Early Hints" },
-    { 200, "OK" },
-    { 201, "Created" },
-    { 202, "Accepted" },
-    { 203, "Non-Authoritative Information" },
-    { 204, "No Content" },
-    { 205, "Reset Content" },
-    { 206, "Partial Content" },
-    { 207, "Multi-Status" },
-    { 208, "Already Reported" },
-    { 226, "IM Used" },
-    { 300, "Multiple Choices" },
-    { 301, "Moved Permanently" },
-    { 302, "Found" },
-    { 303, "See Other" },
-    { 304, "Not Modified" },
-    { 305, "Use Proxy" },
-    { 306, "Switch Proxy" },
-    { 307, "Temporary Redirect" },
-    { 308, "Permanent Redirect" },
-    { 400, "Bad Request" },
-    { 401, "Unauthorized" },
-    { 402, "Payment Required" },
-    { 403, "Forbidden" },
-    { 404, "Not Found" },
-    { 405, "Method Not Allowed" },
-    { 406, "Not Acceptable" },
-    { 407, "Proxy Authentication Required" },
-    { 408, "Request Timeout" },
-    { 409, "Conflict" },
-    { 410, "Gone" },
-    { 411, "Length Required" },
-    { 412, "Precondition Failed" },
-    { 413, "Payload Too Large" },
-    { 414, "URI Too Long" },
-    { 415, "Unsupported Media Type" },
-    { 416, "Range Not Satisfiable" },
-    { 417, "Expectation Failed" },
-    { 418, "I'm a teapot" },
-    { 421, "Misdirected Request" },
-    { 422, "Unprocessable Entity" },
-    { 423, "Locked" },
-    { 424, "Failed Dependency" },
-    { 425, "Too Early" },
-    { 426, "Upgrade Required" },
-    { 428, "Precondition Required" },
-    { 429, "Too Many Requests" },
-    { 431, "Request Header Fields Too Large" },
-    { 451, "Unavailable For Legal Reasons" },
-    { 500, "Internal Server Error" },
-    { 501, "Not Implemented" },
-    { 502, "Bad Gateway" },
-    { 503, "Service Unavailable" },
-    { 504, "Gateway Timeout" },
-    { 505, "HTTP Version Not Supported" },
-    { 506, "Variant Also Negotiates" },
-    { 507, "Insufficient Storage" },
-    { 508, "Loop Detected" },
-    { 510, "Not Extended" },
-    { 511, "Network Authentication Required" },
+#define LIST_OF_HTTP_STATUSES(DO)\
+    DO(100, "Continue")\
+    DO(101, "Switching Protocols")\
+    DO(102, "Processing")\
+    DO(103, "Early Hints")\
+    DO(200, "OK")\
+    DO(201, "Created")\
+    DO(202, "Accepted")\
+    DO(203, "Non-Authoritative Information")\
+    DO(204, "No Content")\
+    DO(205, "Reset Content")\
+    DO(206, "Partial Content")\
+    DO(207, "Multi-Status")\
+    DO(208, "Already Reported")\
+    DO(226, "IM Used")\
+    DO(300, "Multiple Choices")\
+    DO(301, "Moved Permanently")\
+    DO(302, "Found")\
+    DO(303, "See Other")\
+    DO(304, "Not Modified")\
+    DO(305, "Use Proxy")\
+    DO(306, "Switch Proxy")\
+    DO(307, "Temporary Redirect")\
+    DO(308, "Permanent Redirect")\
+    DO(400, "Bad Request")\
+    DO(401, "Unauthorized")\
+    DO(402, "Payment Required")\
+    DO(403, "Forbidden")\
+    DO(404, "Not Found")\
+    DO(405, "Method Not Allowed")\
+    DO(406, "Not Acceptable")\
+    DO(407, "Proxy Authentication Required")\
+    DO(408, "Request Timeout")\
+    DO(409, "Conflict")\
+    DO(410, "Gone")\
+    DO(411, "Length Required")\
+    DO(412, "Precondition Failed")\
+    DO(413, "Payload Too Large")\
+    DO(414, "URI Too Long")\
+    DO(415, "Unsupported Media Type")\
+    DO(416, "Range Not Satisfiable")\
+    DO(417, "Expectation Failed")\
+    DO(418, "I'm a teapot")\
+    DO(421, "Misdirected Request")\
+    DO(422, "Unprocessable Entity")\
+    DO(423, "Locked")\
+    DO(424, "Failed Dependency")\
+    DO(425, "Too Early")\
+    DO(426, "Upgrade Required")\
+    DO(428, "Precondition Required")\
+    DO(429, "Too Many Requests")\
+    DO(431, "Request Header Fields Too Large")\
+    DO(451, "Unavailable For Legal Reasons")\
+    DO(500, "Internal Server Error")\
+    DO(501, "Not Implemented")\
+    DO(502, "Bad Gateway")\
+    DO(503, "Service Unavailable")\
+    DO(504, "Gateway Timeout")\
+    DO(505, "HTTP Version Not Supported")\
+    DO(506, "Variant Also Negotiates")\
+    DO(507, "Insufficient Storage")\
+    DO(508, "Loop Detected")\
+    DO(510, "Not Extended")\
+    DO(511, "Network Authentication Required")\
+
+struct StatusLine {
+    u16 status;
+    std::string_view line;
 };
+
+#define STATUS_LINE(status, reason) { status, "HTTP/1.1 " #status " " reason "\r\n" },
+static constexpr StatusLine STATUS_LINES[] = {
+    LIST_OF_HTTP_STATUSES(STATUS_LINE)
+};
+
+static constexpr u16 MIN_STATUS = 100;
+static constexpr u16 MAX_STATUS = 599;
+// The length of "HTTP/1.1 200 "
+static constexpr size_t STATUS_LINE_PREFIX_LENGTH = 13;
+
+// The status lines indexed by the status minus MIN_STATUS, empty for unknown statuses
+static constexpr auto STATUS_LINE_TABLE = [] {
+    std::array<std::string_view, MAX_STATUS - MIN_STATUS + 1> table = {};
+    for (const auto& s : STATUS_LINES) {
+        table[s.status - MIN_STATUS] = s.line;
+    }
+    return table;
+}();
+
 const std::string_view UNKNOWN_STATUS = "Unknown Status";
 
-void HttpResponseHeader::set_content_length(size_t length) {
-    headers["Content-Length"] = fmt::format("{}", length);
+std::string_view get_status_line(u16 status) {
+    if (status < MIN_STATUS || status > MAX_STATUS) return {};
+    return STATUS_LINE_TABLE[status - MIN_STATUS];
 }
 
-const std::string_view& HttpResponseHeader::status_to_string() const {
-    auto reason_phrase_search = STATUS_REASON_PHRASES.find(status);
-    return reason_phrase_search != STATUS_REASON_PHRASES.end() ? reason_phrase_search->second : UNKNOWN_STATUS;
+static constexpr std::string_view SERVER_FIELD = "Server: http-server\r\n";
+
+void HeaderBuffer::append_number(u64 n) {
+    char digits[20];
+    const auto result = std::to_chars(std::begin(digits), std::end(digits), n);
+    append(std::string_view(digits, result.ptr - digits));
 }
 
-std::string HttpResponseHeader::build() const {
-    auto res = fmt::memory_buffer();
-    auto inserter = std::back_inserter(res);
+static constexpr std::string_view DAY_NAMES[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static constexpr std::string_view MONTH_NAMES[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 
-    auto reason_phrase = status_to_string();
-    fmt::format_to(inserter, "{} {} {}\r\n", HTTP_VERSION_1_1, status, reason_phrase);
+// The length of "Sun, 06 Nov 1994 08:49:37 GMT"
+static constexpr size_t HTTP_DATE_LENGTH = 29;
 
-    for (const auto& h : headers) {
-        fmt::format_to(inserter, "{}: {}\r\n", h.first, h.second);
-    }
+// Formats the time in the IMF-fixdate format of RFC 9110 without looking at the locale
+static void format_http_date(time_t time, char* out) {
+    tm t;
+    gmtime_r(&time, &t);
 
-    fmt::format_to(inserter, "\r\n");
+    auto two_digits = [](char* out, int n) {
+        out[0] = '0' + n / 10;
+        out[1] = '0' + n % 10;
+    };
+    std::copy_n(DAY_NAMES[t.tm_wday].data(), 3, out);
+    out[3] = ',';
+    out[4] = ' ';
+    two_digits(out + 5, t.tm_mday);
+    out[7] = ' ';
+    std::copy_n(MONTH_NAMES[t.tm_mon].data(), 3, out + 8);
+    out[11] = ' ';
+    const int year = t.tm_year + 1900;
+    two_digits(out + 12, year / 100 % 100);
+    two_digits(out + 14, year % 100);
+    out[16] = ' ';
+    two_digits(out + 17, t.tm_hour);
+    out[19] = ':';
+    two_digits(out + 20, t.tm_min);
+    out[22] = ':';
+    two_digits(out + 23, t.tm_sec);
+    std::copy_n(" GMT", 4, out + 25);
+}
 
-    return fmt::to_string(res);
+// Parses a date in the IMF-fixdate format. The obsolete formats aren't accepted.
+static std::optional<time_t> parse_http_date(std::string_view date) {
+    if (date.size() != HTTP_DATE_LENGTH || date.substr(3, 2) != ", " || !date.ends_with(" GMT")) return std::nullopt;
+
+    auto number = [&](size_t start, size_t length) -> int {
+        int n = 0;
+        for (char c : date.substr(start, length)) {
+            if (c < '0' || c > '9') return -1;
+            n = n*10 + (c - '0');
+        }
+        return n;
+    };
+    tm t = {};
+    t.tm_mday = number(5, 2);
+    t.tm_year = number(12, 4) - 1900;
+    t.tm_hour = number(17, 2);
+    t.tm_min = number(20, 2);
+    t.tm_sec = number(23, 2);
+    t.tm_mon = std::find(std::begin(MONTH_NAMES), std::end(MONTH_NAMES), date.substr(8, 3)) - std::begin(MONTH_NAMES);
+    if (t.tm_mday < 1 || t.tm_year < 0 || t.tm_hour < 0 || t.tm_min < 0 || t.tm_sec < 0 || t.tm_mon == 12) return std::nullopt;
+    if (date[7] != ' ' || date[11] != ' ' || date[16] != ' ' || date[19] != ':' || date[22] != ':') return std::nullopt;
+
+    return timegm(&t);
 }
 
-std::string HttpResponseHeader::build_error(u16 status) {
-        HttpResponseHeader h;
-        h.status = status;
-        h["Connection"] = "close";
-        h["Content-Type"] = "text/html";
+void HeaderBuffer::append_http_date(std::chrono::system_clock::time_point time) {
+    char date[HTTP_DATE_LENGTH];
+    format_http_date(std::chrono::system_clock::to_time_t(time), date);
+    append(std::string_view(date, sizeof(date)));
+}
 
-        const auto& message = h.status_to_string();
-        h.set_content_length(message.size());
+std::string_view HttpResponseHeader::status_to_string() const {
+    const auto line = get_status_line(status);
+    if (line.empty()) return UNKNOWN_STATUS;
+    return line.substr(STATUS_LINE_PREFIX_LENGTH, line.size() - STATUS_LINE_PREFIX_LENGTH - 2);
+}
 
-        auto response = h.build();
-        response.append(message);
+void HttpResponseHeader::build_content_fields(HeaderBuffer& buffer) const {
+    if (const auto line = get_status_line(status); line.size()) {
+        buffer.append(line);
+    } else {
+        buffer.append(HTTP_VERSION_1_1);
+        buffer.append(" ");
+        buffer.append_number(status);
+        buffer.append(" ");
+        buffer.append(UNKNOWN_STATUS);
+        buffer.append("\r\n");
+    }
 
-        return response;
+    buffer.append(SERVER_FIELD);
+    if (content_type.size()) {
+        buffer.append("Content-Type: ");
+        buffer.append(content_type);
+        buffer.append("\r\n");
+    }
+    if (content_length) {
+        buffer.append("Content-Length: ");
+        buffer.append_number(*content_length);
+        buffer.append("\r\n");
+    }
+    if (complete_length) {
+        buffer.append("Content-Range: bytes ");
+        if (range) {
+            buffer.append_number(range->first);
+            buffer.append("-");
+            buffer.append_number(range->first + range->length - 1);
+        } else {
+            buffer.append("*");
+        }
+        buffer.append("/");
+        buffer.append_number(*complete_length);
+        buffer.append("\r\n");
+    }
+    if (accept_ranges) {
+        buffer.append("Accept-Ranges: bytes\r\n");
+    }
+    if (last_modified) {
+        buffer.append("Last-Modified: ");
+        buffer.append_http_date(*last_modified);
+        buffer.append("\r\n");
+    }
+    if (etag.size()) {
+        buffer.append("ETag: ");
+        buffer.append(etag);
+        buffer.append("\r\n");
+    }
 }
 
+// The Date field of the current second. It's formatted again only once the second has changed.
+static std::string_view date_field() {
+    static constexpr std::string_view PREFIX = "Date: ";
+    thread_local char field[] = "Date: Thu, 01 Jan 1970 00:00:00 GMT\r\n";
+    thread_local time_t formatted_time = 0;
 
-#define METHOD_STRING(method) { HttpMethod::method, #method },
-static const std::unordered_map<HttpMethod, std::string_view> METHOD_STRING_MAP = {
-    LIST_OF_HTTP_METHODS(METHOD_STRING)
-};
+    const auto now = time(nullptr);
+    if (now != formatted_time) {
+        format_http_date(now, field + PREFIX.size());
+        formatted_time = now;
+    }
+    return std::string_view(field, sizeof(field) - 1);
+}
+
+void HttpResponseHeader::build_response_fields(HeaderBuffer& buffer, bool close_connection) {
+    buffer.append(date_field());
+    if (close_connection) {
+        buffer.append("Connection: close\r\n");
+    }
+    buffer.append("\r\n");
+}
 
-#define STRING_METHOD(method) { #method, HttpMethod::method },
-static const std::map<std::string_view, HttpMethod, std::less<>> STRING_METHOD_MAP = {
-    LIST_OF_HTTP_METHODS(STRING_METHOD)
+std::array<asio::const_buffer, 3> prebuilt_response_buffers(std::string_view content_fields, HeaderBuffer& response_fields, bool close_connection, std::span<const char> body) {
+    response_fields.clear();
+    HttpResponseHeader::build_response_fields(response_fields, close_connection);
+    return {
+        asio::buffer(content_fields),
+        asio::buffer(response_fields.view()),
+        asio::buffer(body.data(), body.size()),
+    };
+}
+
+#define METHOD_STRING(method) #method,
+static constexpr std::string_view METHOD_STRINGS[] = {
+    LIST_OF_HTTP_METHODS(METHOD_STRING)
 };
 
 const std::string_view INVALID_METHOD_STRING = "Invalid method";
 const std::string_view& to_string(HttpMethod method) {
-    auto method_search = METHOD_STRING_MAP.find(method);
-    if (method_search == METHOD_STRING_MAP.end()) {
+    if ((size_t)method >= std::size(METHOD_STRINGS)) {
         return INVALID_METHOD_STRING;
     }
-    return method_search->second;
+    return METHOD_STRINGS[(size_t)method];
 }
 
-struct HttpRequestParser {
-    static constexpr size_t MAX_TOKEN_LENGTH = 8*1024;
-    static constexpr size_t MIN_BUFFER_LENGTH = 2*MAX_TOKEN_LENGTH;
-    static constexpr size_t RECEIVE_CHUNK_SIZE = MAX_TOKEN_LENGTH;
+static constexpr size_t MAX_METHOD_LENGTH = 7;
 
-    enum Error {
-        OK = 0,
-        PAYLOAD_TOO_LARGE,
-        SERVER_ERROR,
-        BAD_REQUEST,
-    };
+// The bytes of a method and its length as one integer, so the methods can be case labels
+static constexpr u64 pack_method(std::string_view method) {
+    u64 packed = (u64)method.size() << 56;
+    for (size_t i = 0; i < method.size(); ++i) {
+        packed |= (u64)(u8)method[i] << (8*i);
+    }
+    return packed;
+}
 
-    asio::ip::tcp::socket& connection;
-    RingBuffer b;
-    size_t p = 0, end = 0;
-    ssize_t token_start = -1;
+#define METHOD_CASE(method) case pack_method(#method): return HttpMethod::method;
+static std::optional<HttpMethod> parse_method(std::string_view token) {
+    if (token.size() > MAX_METHOD_LENGTH) return std::nullopt;
+    switch (pack_method(token)) {
+        LIST_OF_HTTP_METHODS(METHOD_CASE)
+        default: return std::nullopt;
+    }
+}
 
-    HttpRequestParser(asio::ip::tcp::socket& connection, RingBuffer&& buffer) : connection(connection), b(std::move(buffer)) {}
+#define HEADER_NAME(id, name) name,
+static constexpr PerfectHashTable<6, KNOWN_HTTP_HEADER_COUNT> HEADER_TABLE(std::to_array<std::string_view>({
+    LIST_OF_KNOWN_HTTP_HEADERS(HEADER_NAME)
+}));
 
-    static tl::expected<HttpRequestParser, const char*> create(asio::ip::tcp::socket& connection) {
-        auto buffer = RingBuffer::create(MIN_BUFFER_LENGTH);
-        if (!buffer) {
-            return tl::unexpected(buffer.error());
+HttpHeaderId get_header_id(std::string_view name) {
+    return (HttpHeaderId)HEADER_TABLE.find(name);
+}
+
+// The bytes allowed in a token, like a header name (RFC 9110, 5.6.2)
+static constexpr auto TOKEN_CHARACTERS = [] {
+    std::array<bool, 256> table = {};
+    for (int c = '0'; c <= '9'; ++c) table[c] = true;
+    for (int c = 'a'; c <= 'z'; ++c) table[c] = table[c - 'a' + 'A'] = true;
+    for (char c : std::string_view("!#$%&'*+-.^_`|~")) table[(u8)c] = true;
+    return table;
+}();
+
+static bool is_token(std::string_view s) {
+    if (s.empty()) return false;
+    for (char c : s) {
+        if (!TOKEN_CHARACTERS[(u8)c]) return false;
+    }
+    return true;
+}
+
+// The headers that frame or route the request, which must be sent at most once
+static bool is_singleton_header(HttpHeaderId id) {
+    return id == HttpHeaderId::CONTENT_LENGTH || id == HttpHeaderId::HOST || id == HttpHeaderId::TRANSFER_ENCODING;
+}
+
+const std::string_view* HttpRequest::find_header(std::string_view name) const {
+    if (auto id = get_header_id(name); id != HttpHeaderId::UNKNOWN) {
+        const auto& value = known_headers[(size_t)id];
+        return value.data() ? &value : nullptr;
+    }
+
+    for (const auto& h : headers) {
+        if (h.id == HttpHeaderId::UNKNOWN && ascii_iequals(h.name, name)) return &h.value;
+    }
+    return nullptr;
+}
+
+void HttpRequest::move_views(const char* from, size_t length, const char* to) {
+    auto move = [&](std::string_view& view) {
+        // A path that isn't in the buffer is a string literal
+        const auto offset = (uintptr_t)view.data() - (uintptr_t)from;
+        if (offset < length) {
+            view = std::string_view(to + offset, view.size());
         }
+    };
+    move(path);
+    move(query);
+    move(fragment);
+    for (auto& h : headers) {
+        move(h.name);
+        move(h.value);
+    }
+    for (auto& value : known_headers) {
+        move(value);
+    }
+}
 
-        return HttpRequestParser(connection, std::move(*buffer));
+// Whether an element of the comma-separated list satisfies matches
+template<class F> static bool any_list_element(std::string_view list, F matches) {
+    while (list.size()) {
+        auto comma = list.find(',');
+        auto element = list.substr(0, comma);
+        while (element.size() && (element.front() == ' ' || element.front() == '\t')) element.remove_prefix(1);
+        while (element.size() && (element.back() == ' ' || element.back() == '\t')) element.remove_suffix(1);
+        if (matches(element)) return true;
+
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Whether an element of the list header satisfies matches. The lines of a
+// repeated header are read as one list (RFC 9110, 5.3).
+template<class F> static bool any_header_element(const HttpRequest& request, HttpHeaderId id, F matches) {
+    if (!request.repeated_headers[(size_t)id]) {
+        return any_list_element(request.header(id), matches);
+    }
+    for (const auto& h : request.headers) {
+        if (h.id == id && any_list_element(h.value, matches)) return true;
     }
+    return false;
+}
+
+bool HttpRequest::wants_connection_close() const {
+    return any_header_element(*this, HttpHeaderId::CONNECTION, [](std::string_view option) {
+        return ascii_iequals(option, "close");
+    });
+}
 
-    static bool is_whitespace(char c) {
-        return c == ' ' || c == '\t';
+bool HttpRequest::is_not_modified(std::string_view etag, std::chrono::system_clock::time_point last_modified) const {
+    if (method != HttpMethod::GET && method != HttpMethod::HEAD) return false;
+
+    // If-Modified-Since is ignored when If-None-Match is sent
+    if (const auto if_none_match = header(HttpHeaderId::IF_NONE_MATCH); if_none_match.size()) {
+        // The weak comparison, which ignores the W/ prefix
+        return any_header_element(*this, HttpHeaderId::IF_NONE_MATCH, [&](std::string_view tag) {
+            if (tag.starts_with("W/")) tag.remove_prefix(2);
+            return tag == "*" || tag == etag;
+        });
     }
 
-    static bool is_whitespace_or_line_break(char c) {
-        return is_whitespace(c) || c == '\r' || c == '\n';
+    if (const auto if_modified_since = header(HttpHeaderId::IF_MODIFIED_SINCE); if_modified_since.size()) {
+        // An invalid date is ignored
+        const auto since = parse_http_date(if_modified_since);
+        return since && std::chrono::system_clock::to_time_t(last_modified) <= *since;
     }
+    return false;
+}
 
-    awaitable<Error> ensure_data(size_t length) {
-        if (p + length <= end) co_return OK;
+// Parses the digits of s, failing on anything else or on overflow
+static std::optional<u64> parse_u64(std::string_view s) {
+    u64 n = 0;
+    const auto result = std::from_chars(s.data(), s.data() + s.size(), n);
+    if (s.empty() || result.ec != std::errc() || result.ptr != s.data() + s.size()) return std::nullopt;
+    return n;
+}
 
-        if (!b.is_in_range(end - 1 + RECEIVE_CHUNK_SIZE)) {
-            co_return PAYLOAD_TOO_LARGE;
+// Merges the ranges, if any of them overlap or are adjacent, into ranges in
+// ascending order (RFC 9110, 14.2). No byte is then sent twice, so the
+// parts are never larger than the whole representation. Otherwise the
+// ranges are left in the order requested.
+static void coalesce_ranges(ByteRanges& ranges) {
+    auto sorted = ranges;
+    std::sort(sorted.begin(), sorted.end(), [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; });
+
+    bool mergeable = false;
+    for (size_t i = 1; i < sorted.size() && !mergeable; ++i) {
+        mergeable = sorted[i].first <= sorted[i - 1].first + sorted[i - 1].length;
+    }
+    if (!mergeable) return;
+
+    ranges.clear();
+    for (const auto& range : sorted) {
+        if (ranges.size() && range.first <= ranges.back().first + ranges.back().length) {
+            auto& last = ranges.back();
+            last.length = std::max(last.first + last.length, range.first + range.length) - last.first;
+        } else {
+            ranges.push_back(range);
         }
+    }
+}
 
-        boost::system::error_code ec;
-        auto received_bytes = co_await async_read(connection, asio::buffer(&b[end], RECEIVE_CHUNK_SIZE), asio::transfer_at_least(length), RE(ec));
-        if (ec) {
-            co_return ec == asio::error::eof || ec == asio::error::connection_reset ? BAD_REQUEST : SERVER_ERROR;
+HttpRequest::RangeResult HttpRequest::requested_ranges(u64 size, std::string_view etag, std::chrono::system_clock::time_point last_modified, ByteRanges& ranges) const {
+    using enum RangeResult;
+    ranges.clear();
+
+    auto range = header(HttpHeaderId::RANGE);
+    if (method != HttpMethod::GET || range.empty()) return WHOLE;
+
+    // A representation that has changed is sent whole
+    if (const auto if_range = header(HttpHeaderId::IF_RANGE); if_range.size()) {
+        if (if_range.starts_with('"')) {
+            if (if_range != etag) return WHOLE;
+        } else {
+            const auto date = parse_http_date(if_range);
+            if (!date || *date != std::chrono::system_clock::to_time_t(last_modified)) return WHOLE;
         }
-        if (received_bytes < length) {
-            co_return BAD_REQUEST;
+    }
+
+    if (range.size() < 6 || !ascii_iequals(range.substr(0, 6), "bytes=")) return WHOLE;
+    range.remove_prefix(6);
+
+    size_t count = 0;
+    bool valid = true;
+    any_list_element(range, [&](std::string_view spec) {
+        // Empty elements are allowed in lists
+        if (spec.empty()) return false;
+        if (++count > MAX_RANGE_COUNT) {
+            valid = false;
+            return true;
         }
 
-        if (token_start >= 0 && (end - (size_t)token_start) > 0) {
-            auto n_start = b.normalized_index((size_t)token_start);
-            auto n_end = b.normalized_index(end);
-            auto n_new_end = b.normalized_index(end + received_bytes);
-            bool end_wrapped = n_new_end <= n_end;
-
-            bool overwritten;
-            if (n_start <= n_end) {
-                overwritten = end_wrapped && n_start < n_new_end;
-            } else {
-                // n_start > n_end
-                overwritten = end_wrapped || n_start < n_new_end;
+        const auto dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            valid = false;
+            return true;
+        }
+        const auto first = parse_u64(spec.substr(0, dash));
+        const auto last_part = spec.substr(dash + 1);
+        const auto last = parse_u64(last_part);
+
+        if (!first) {
+            // A suffix: the last bytes
+            if (dash != 0 || !last) {
+                valid = false;
+                return true;
             }
-
-            if (overwritten) co_return PAYLOAD_TOO_LARGE;
+            if (*last > 0 && size > 0) {
+                const auto length = std::min(*last, size);
+                ranges.push_back({ size - length, length });
+            }
+            return false;
         }
 
-        end += received_bytes;
-        if (token_start == -1) {
-            normalize();
+        if ((last_part.size() && !last) || (last && *last < *first)) {
+            valid = false;
+            return true;
+        }
+        if (*first < size) {
+            const u64 end = last ? std::min(*last, size - 1) + 1 : size;
+            ranges.push_back({ *first, end - *first });
         }
-        co_return OK;
+        return false;
+    });
+
+    if (!valid || count == 0) {
+        ranges.clear();
+        return WHOLE;
+    }
+    if (ranges.size() > 1) {
+        coalesce_ranges(ranges);
     }
+    return ranges.empty() ? UNSATISFIABLE : PARTIAL;
+}
 
-    void normalize() {
-        bool was_empty = empty();
+bool HttpRequest::has_invalid_framing() const {
+    if (!has_header(HttpHeaderId::CONTENT_LENGTH)) return false;
+    return has_header(HttpHeaderId::TRANSFER_ENCODING) || !parse_u64(header(HttpHeaderId::CONTENT_LENGTH));
+}
 
-        p = b.normalized_index(p);
-        end = b.normalized_index(end);
+bool HttpRequest::has_body() const {
+    if (has_header(HttpHeaderId::TRANSFER_ENCODING)) return true;
+    const auto content_length = header(HttpHeaderId::CONTENT_LENGTH);
+    return content_length.size() && content_length != "0";
+}
 
-        if (!was_empty && end == 0) {
-            end = b.length;
+HttpRequestParser::~HttpRequestParser() {
+    // The pool the buffer came from, see RingBufferPool
+    RingBufferPool::local().release(std::move(b));
+}
+
+awaitable<HttpRequestParser::Error> HttpRequestParser::ensure_data(size_t length) {
+    if (p + length <= end) co_return OK;
+    const size_t missing = p + length - end;
+    assert(b.buffer);
+
+    // The live bytes mustn't be overwritten by the received bytes
+    if (b.length - (end - live_start()) < missing) {
+        const size_t needed_length = end - live_start() + missing;
+        if (needed_length > max_buffer_length) {
+            co_return PAYLOAD_TOO_LARGE;
         }
-        if (end < p) {
-            end += b.length;
-            assert(end >= p);
+        if (auto error = resize_buffer(std::min(std::max(2*b.length, needed_length), max_buffer_length))) {
+            co_return error;
         }
     }
 
-    bool empty() {
-        return p == end;
-    }
+    // Thanks to the copies of the buffer, the same bytes can be reached a
+    // buffer length lower. With the live bytes starting in the first copy,
+    // the received bytes always fit in the mapped range.
+    shift_indices(live_start() / b.length * b.length);
 
-    std::string_view get_current_token() {
-        if (token_start == -1) return {};
+    const size_t free_length = b.length - (end - live_start());
+    const size_t receive_length = std::min(free_length, RECEIVE_CHUNK_SIZE);
+    assert(receive_length >= missing && b.is_in_range(end + receive_length - 1));
 
-        auto start = token_start;
-        auto length = p - start;
+    boost::system::error_code ec;
+    auto received_bytes = co_await async_read(connection, asio::buffer(&b[end], receive_length), asio::transfer_at_least(missing), RE(ec));
+    if (ec == asio::error::operation_aborted) {
+        co_return TIMED_OUT;
+    }
+    if (ec) {
+        co_return ec == asio::error::eof || ec == asio::error::connection_reset ? BAD_REQUEST : SERVER_ERROR;
+    }
+    if (received_bytes < missing) {
+        co_return BAD_REQUEST;
+    }
 
-        token_start = -1;
+    end += received_bytes;
+    if (token_start == -1 && request_start == -1) {
         normalize();
+    }
+    co_return OK;
+}
 
-        return { &b[start], length };
+HttpRequestParser::Error HttpRequestParser::resize_buffer(size_t length) {
+    auto& pool = RingBufferPool::local();
+    auto buffer = pool.acquire(length);
+    if (!buffer) {
+        fmt::print(stderr, "Error while resizing the request buffer: {}\n", buffer.error());
+        return SERVER_ERROR;
     }
 
-    awaitable<Error> eat_whitespace() {
-        while (true) {
-            if (auto error = co_await ensure_data(1)) co_return error;
-            if (!is_whitespace(b[p])) co_return OK;
-            ++p;
-        }
+    // The live bytes are contiguous in the copies of the old buffer
+    const size_t start = live_start();
+    const size_t live_length = end - start;
+    assert(live_length <= buffer->length);
+    if (live_length) {
+        memcpy(&(*buffer)[0], &b[start], live_length);
     }
 
-    awaitable<tl::expected<bool, Error>> maybe_read_newline() {
-        if (auto error = co_await ensure_data(2)) co_return tl::unexpected(error);
+    shift_indices(start);
 
-        if (b[p] == '\r' && b[p + 1] == '\n') {
-            p += 2;
-            co_return true;
-        }
+    pool.release(std::move(b));
+    b = std::move(*buffer);
+    return OK;
+}
 
-        co_return false;
-    }
+size_t HttpRequestParser::live_start() const {
+    if (request_start >= 0) return request_start;
+    if (token_start >= 0) return token_start;
+    return p;
+}
 
-    awaitable<tl::expected<std::string_view, Error>> read_until_whitespace() {
-        token_start = p;
+void HttpRequestParser::shift_indices(size_t offset) {
+    p -= offset;
+    end -= offset;
+    if (token_start >= 0) token_start -= offset;
+    if (request_start >= 0) request_start -= offset;
+}
 
-        while (true) {
-            if (auto error = co_await ensure_data(1)) co_return tl::unexpected(error);
-            if (is_whitespace_or_line_break(b[p])) break;
-            ++p;
+awaitable<HttpRequestParser::Error> HttpRequestParser::wait_for_request() {
+    assert(token_start == -1 && request_start == -1);
+
+    if (empty()) {
+        RingBufferPool::local().release(std::move(b));
+        b = {};
+        p = end = 0;
+
+        boost::system::error_code ec;
+        co_await connection.async_wait(asio::ip::tcp::socket::wait_read, RE(ec));
+        if (ec) {
+            // Cancelled by the idle timer, or the connection failed
+            co_return CONNECTION_CLOSED;
         }
+    }
 
-        co_return get_current_token();
+    // Borrows a buffer if there's none, and a large request doesn't keep its
+    // buffer for the rest of the connection
+    if (b.length != MIN_BUFFER_LENGTH && end - p <= MIN_BUFFER_LENGTH) {
+        if (auto error = resize_buffer(MIN_BUFFER_LENGTH)) co_return error;
     }
 
-    awaitable<tl::expected<std::string_view, Error>> read_line() {
-        token_start = p;
+    if (auto error = co_await ensure_data(1)) {
+        co_return error == BAD_REQUEST || error == TIMED_OUT ? CONNECTION_CLOSED : error;
+    }
+    co_return OK;
+}
 
-        while (true) {
-            if (auto error = co_await ensure_data(2)) co_return tl::unexpected(error);
-            if (b[p] == '\r' && b[p + 1] == '\n') break;
-            ++p;
-        }
+void HttpRequestParser::normalize() {
+    bool was_empty = empty();
 
-        auto token = get_current_token();
-        p += 2;
-        co_return token;
-    }
+    p = b.normalized_index(p);
+    end = b.normalized_index(end);
 
-    awaitable<tl::expected<std::string_view, Error>> read_header_name() {
-        token_start = p;
+    if (!was_empty && end == 0) {
+        end = b.length;
+    }
+    if (end < p) {
+        end += b.length;
+        assert(end >= p);
+    }
+}
 
-        while (true) {
-            if (auto error = co_await ensure_data(1)) co_return tl::unexpected(error);
-            if (b[p] == ':') break;
-            ++p;
-        }
+// Advances p to the first of the characters Cs. Returns false if the
+// received bytes ran out before one of them.
+template<char... Cs> bool HttpRequestParser::scan() {
+    const char* base = &b[0];
+    p = scan_for<Cs...>(base + p, base + end) - base;
+    return p < end;
+}
 
-        auto token = get_current_token();
+// Returns false if the received bytes ran out before a byte that isn't whitespace
+bool HttpRequestParser::skip_whitespace() {
+    while (p < end && is_whitespace(b[p])) {
         ++p;
+    }
+    return p < end;
+}
 
-        if (!token.size() || is_whitespace_or_line_break(token[token.size() - 1])) {
-            co_return tl::unexpected(BAD_REQUEST);
-        }
+// Whether a CRLF starts at p. There must be two bytes from p.
+bool HttpRequestParser::at_line_break() {
+    return b[p] == '\r' && b[p + 1] == '\n';
+}
+
+std::string_view HttpRequestParser::take_token() {
+    assert(token_start >= 0);
+    std::string_view token(&b[token_start], p - token_start);
+    token_start = -1;
+    return token;
+}
 
-        co_return token;
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes the percent-encoded bytes of the path in place. The bytes up to the
+// first '%' stay where they are, so a path without one isn't written to.
+// Returns false for a malformed encoding, or one of a NUL byte.
+static bool percent_decode(char* path, size_t& length) {
+    const char* const end = path + length;
+    const char* r = scan_for<'%'>(path, end);
+    char* w = path + (r - path);
+
+    while (r < end) {
+        // *r is '%'
+        if (end - r < 3) return false;
+        const int high = hex_digit_value(r[1]), low = hex_digit_value(r[2]);
+        if (high < 0 || low < 0 || (high == 0 && low == 0)) return false;
+        *w++ = high*16 + low;
+        r += 3;
+
+        const char* next = scan_for<'%'>(r, end);
+        memmove(w, r, next - r);
+        w += next - r;
+        r = next;
     }
 
-    awaitable<tl::expected<std::string_view, Error>> read_header_field() {
-        auto line = co_await read_line();
-        if (!line) co_return tl::unexpected(line.error());
-        auto& field = *line;
+    length = w - path;
+    return true;
+}
 
-        while (field.size() && is_whitespace(field[field.size() - 1])) {
-            field.remove_suffix(1);
+// Removes the "." and ".." segments of the path in place (RFC 3986, 5.2.4)
+// and returns its new length. ".." segments don't go above the root.
+static size_t remove_dot_segments(char* path, size_t length) {
+    size_t w = 0;
+    size_t r = 0;
+    while (r < length) {
+        // path[r] is '/'
+        size_t segment_end = r + 1;
+        while (segment_end < length && path[segment_end] != '/') {
+            ++segment_end;
         }
+        const std::string_view segment(path + r + 1, segment_end - r - 1);
+        const bool is_last = segment_end == length;
 
-        if (!field.size()) co_return tl::unexpected(BAD_REQUEST);
-        co_return field;
+        if (segment == "." || segment == "..") {
+            if (segment == "..") {
+                while (w > 0 && path[--w] != '/') {}
+            }
+            // The path still refers to a directory
+            if (is_last) path[w++] = '/';
+        } else {
+            path[w++] = '/';
+            memmove(path + w, segment.data(), segment.size());
+            w += segment.size();
+        }
+        r = segment_end;
     }
 
-    awaitable<tl::expected<std::string, Error>> read_request_target_returning_path() {
-        auto token = co_await read_until_whitespace();
-        if (!token) co_return tl::unexpected(token.error());
-        auto& request_target = *token;
+    if (w == 0) path[w++] = '/';
+    return w;
+}
+
+// Takes the request target as the token and splits it into the path, the
+// query and the fragment. The target is in origin-form ("/path?query") or
+// absolute-form ("http://host/path?query"). The path is decoded and
+// normalized in place, since that never makes it longer. Returns false for a
+// malformed target.
+bool HttpRequestParser::take_request_target(HttpRequest& request) {
+    const auto token = take_token();
+    char* const target = &b[p - token.size()];
+    const char* const target_end = target + token.size();
+
+    if (scan_for_control_character(target, target_end) != target_end) return false;
+
+    char* path = target;
+    if (token.empty()) return false;
+    if (token[0] != '/') {
+        // absolute-form: the authority is skipped, since there's only one host
+        const auto scheme_end = token.find("://");
+        if (scheme_end == std::string_view::npos) return false;
+        const auto scheme = token.substr(0, scheme_end);
+        if (!ascii_iequals(scheme, "http") && !ascii_iequals(scheme, "https")) return false;
+
+        const char* authority = target + scheme_end + 3;
+        path = const_cast<char*>(scan_for<'/', '?', '#'>(authority, target_end));
+        if (path == authority) return false;
+    }
 
-        auto it = request_target.begin();
-        while (it != request_target.end() && *it != '/') {
-            ++it;
+    const char* path_end = scan_for<'?', '#'>(path, target_end);
+    if (path_end < target_end && *path_end == '?') {
+        const char* query_end = scan_for<'#'>(path_end, target_end);
+        request.query = std::string_view(path_end + 1, query_end - path_end - 1);
+        if (query_end < target_end) {
+            request.fragment = std::string_view(query_end + 1, target_end - query_end - 1);
         }
-        if (it == request_target.end()) co_return "/";
-
-        std::string path = "/";
-
-        while (++it != request_target.end()) {
-            if (*it == '?') break;
-            if (*it != '%') {
-                path.push_back(*it);
-            } else {
-                if (++it == request_target.end()) co_return "/"; // Invalid URI
-                if (*it == '%') {
-                    path.push_back('%');
-                    continue;
-                }
+    } else if (path_end < target_end) {
+        request.fragment = std::string_view(path_end + 1, target_end - path_end - 1);
+    }
 
-                char hex[3] = { '\0' };
-                hex[0] = *it;
+    size_t path_length = path_end - path;
+    if (path_length == 0) {
+        // An absolute-form target may have an empty path
+        request.path = "/";
+        return true;
+    }
+
+    if (!percent_decode(path, path_length)) return false;
+    // A decoded path may start with something else than '/', like "%2e"
+    if (path[0] != '/') return false;
+    if (std::string_view(path, path_length).find("/.") != std::string_view::npos) {
+        path_length = remove_dot_segments(path, path_length);
+    }
+    request.path = std::string_view(path, path_length);
+    return true;
+}
+
+HttpRequestParser::ParseResult HttpRequestParser::parse(HttpRequest& request) {
+    using enum ParseResult;
 
-                if (++it == request_target.end()) co_return "/"; // Invalid URI
-                hex[1] = *it;
+    while (true) {
+        switch (state) {
+            case State::REQUEST_START:
+                // An empty line before the request line is ignored
+                if (end - p < 2) return NEED_MORE;
+                if (at_line_break()) p += 2;
+                request_start = p;
+                token_start = p;
+                state = State::METHOD;
+                break;
+
+            case State::METHOD: {
+                if (!scan<' ', '\t', '\r', '\n'>()) return NEED_MORE;
+                const auto method = parse_method(take_token());
+                if (!method) return UNKNOWN_METHOD;
+                request.method = *method;
+                state = State::TARGET_START;
+                break;
+            }
 
-                auto value = strtoul(hex, nullptr, 16);
-                assert(value <= std::numeric_limits<char>::max());
-                path.push_back(value);
+            case State::TARGET_START:
+                if (!skip_whitespace()) return NEED_MORE;
+                token_start = p;
+                state = State::TARGET;
+                break;
+
+            case State::TARGET:
+                if (!scan<' ', '\t', '\r', '\n'>()) return NEED_MORE;
+                if (!take_request_target(request)) return BAD_REQUEST;
+                state = State::VERSION_START;
+                break;
+
+            case State::VERSION_START:
+                if (!skip_whitespace()) return NEED_MORE;
+                token_start = p;
+                state = State::VERSION;
+                break;
+
+            case State::VERSION:
+                if (!scan<' ', '\t', '\r', '\n'>()) return NEED_MORE;
+                if (take_token() != HTTP_VERSION_1_1) return UNSUPPORTED_HTTP_VERSION;
+                state = State::REQUEST_LINE_END;
+                break;
+
+            case State::REQUEST_LINE_END:
+                if (end - p < 2) return NEED_MORE;
+                if (!at_line_break()) return BAD_REQUEST;
+                p += 2;
+                state = State::HEADER_START;
+                break;
+
+            case State::HEADER_START:
+                if (end - p < 2) return NEED_MORE;
+                if (at_line_break()) {
+                    p += 2;
+                    request_start = -1;
+                    state = State::REQUEST_START;
+                    return DONE;
+                }
+                // A folded line (obs-fold) would continue the previous value
+                if (is_whitespace(b[p])) return BAD_REQUEST;
+                token_start = p;
+                state = State::HEADER_NAME;
+                break;
+
+            case State::HEADER_NAME: {
+                // A line without a colon mustn't run into the next one
+                if (!scan<':', '\r', '\n'>()) return NEED_MORE;
+                if (b[p] != ':') return BAD_REQUEST;
+                auto name = take_token();
+                ++p;
+                if (!is_token(name)) return BAD_REQUEST;
+                request.headers.push_back({ get_header_id(name), name, {} });
+                state = State::HEADER_VALUE_START;
+                break;
             }
-        }
 
-        co_return path;
+            case State::HEADER_VALUE_START:
+                if (!skip_whitespace()) return NEED_MORE;
+                token_start = p;
+                state = State::HEADER_VALUE;
+                break;
+
+            case State::HEADER_VALUE: {
+                if (!scan<'\r', '\n', '\0'>() || end - p < 2) return NEED_MORE;
+                // A CR, LF or NUL inside the value. A bare CR or LF would end
+                // the line for some readers and not for others.
+                if (!at_line_break()) return BAD_REQUEST;
+                auto value = take_token();
+                p += 2;
+                while (value.size() && is_whitespace(value.back())) {
+                    value.remove_suffix(1);
+                }
+                auto& header = request.headers.back();
+                header.value = value;
+                if (header.id != HttpHeaderId::UNKNOWN) {
+                    auto& known = request.known_headers[(size_t)header.id];
+                    if (!known.data()) {
+                        known = value;
+                    } else {
+                        // Which of the values to follow can't be told. The
+                        // same Content-Length twice is allowed (RFC 9110, 8.6).
+                        const bool same_content_length = header.id == HttpHeaderId::CONTENT_LENGTH && value == known;
+                        if (is_singleton_header(header.id) && !same_content_length) return BAD_REQUEST;
+                        request.repeated_headers.set((size_t)header.id);
+                    }
+                }
+                state = State::HEADER_START;
+                break;
+            }
+        }
     }
-};
+}
 
 static HttpRequest::ReceiveError parse_error_to_receive_error(HttpRequestParser::Error parse_error) {
     using R = HttpRequest::ReceiveError;
@@ -367,6 +936,10 @@ static HttpRequest::ReceiveError parse_error_to_receive_error(HttpRequestParser:
     switch (parse_error) {
         case P::OK:
             return R::SERVER_ERROR;
+        case P::CONNECTION_CLOSED:
+            return R::CONNECTION_CLOSED;
+        case P::TIMED_OUT:
+            return R::TIMED_OUT;
         case P::PAYLOAD_TOO_LARGE:
             return R::PAYLOAD_TOO_LARGE;
         case P::SERVER_ERROR:
@@ -377,73 +950,38 @@ static HttpRequest::ReceiveError parse_error_to_receive_error(HttpRequestParser:
     return R::SERVER_ERROR;
 }
 
-awaitable<tl::expected<HttpRequest, HttpRequest::ReceiveError>> HttpRequest::receive(asio::ip::tcp::socket& connection) {
+awaitable<tl::expected<HttpRequest, HttpRequest::ReceiveError>> HttpRequest::receive(HttpRequestParser& parser) {
     using enum ReceiveError;
+    using Result = HttpRequestParser::ParseResult;
     HttpRequest request;
-    auto parser_creation = HttpRequestParser::create(connection);
-    if (!parser_creation) {
-        co_return tl::unexpected(SERVER_ERROR);
-    }
-    auto& parser = *parser_creation;
-
-    if (auto result = co_await parser.maybe_read_newline(); !result) {
-        co_return tl::unexpected(parse_error_to_receive_error(result.error()));
-    }
-    auto method_string = co_await parser.read_until_whitespace();
-    if (!method_string) co_return tl::unexpected(parse_error_to_receive_error(method_string.error()));
-    auto method_search = STRING_METHOD_MAP.find(*method_string);
-    if (method_search == STRING_METHOD_MAP.end()) {
-        co_return tl::unexpected(UNKNOWN_METHOD);
-    }
-    request.method = method_search->second;
-
-    if (auto error = co_await parser.eat_whitespace()) {
-        co_return tl::unexpected(parse_error_to_receive_error(error));
-    }
-    auto path = co_await parser.read_request_target_returning_path();
-    if (!path) co_return tl::unexpected(parse_error_to_receive_error(path.error()));
-    request.path = *path;
 
-    if (auto error = co_await parser.eat_whitespace()) {
+    if (auto error = co_await parser.wait_for_request()) {
         co_return tl::unexpected(parse_error_to_receive_error(error));
     }
-    auto http_version = co_await parser.read_until_whitespace();
-    if (!http_version) {
-        co_return tl::unexpected(parse_error_to_receive_error(http_version.error()));
-    }
-    if (*http_version != HTTP_VERSION_1_1) {
-        co_return tl::unexpected(UNSUPPORTED_HTTP_VERSION);
-    }
-
-    if (auto result = co_await parser.maybe_read_newline(); !result) {
-        co_return tl::unexpected(parse_error_to_receive_error(result.error()));
-    } else if (!*result) {
-        co_return tl::unexpected(BAD_REQUEST);
-    }
 
+    // Parses what has been received and receives more until the request is complete
     while (true) {
-        if (auto read_newline = co_await parser.maybe_read_newline(); !read_newline) {
-            co_return tl::unexpected(parse_error_to_receive_error(read_newline.error()));
-        } else if (*read_newline) {
-            break;
-        }
-
-        auto header_name_result = co_await parser.read_header_name();
-        if (!header_name_result) {
-            co_return tl::unexpected(parse_error_to_receive_error(header_name_result.error()));
+        switch (parser.parse(request)) {
+            case Result::DONE:
+                co_return request;
+            case Result::NEED_MORE:
+                break;
+            case Result::BAD_REQUEST:
+                co_return tl::unexpected(BAD_REQUEST);
+            case Result::UNKNOWN_METHOD:
+                co_return tl::unexpected(UNKNOWN_METHOD);
+            case Result::UNSUPPORTED_HTTP_VERSION:
+                co_return tl::unexpected(UNSUPPORTED_HTTP_VERSION);
         }
-        std::string header_name(*header_name_result);
 
-        if (auto error = co_await parser.eat_whitespace()) {
+        // Receiving may move the bytes of the request
+        const auto request_data = parser.request_data();
+        const auto request_length = parser.end - parser.request_start;
+        if (auto error = co_await parser.ensure_data(parser.end - parser.p + 1)) {
             co_return tl::unexpected(parse_error_to_receive_error(error));
         }
-
-        auto field = co_await parser.read_header_field();
-        if (!field) {
-            co_return tl::unexpected(parse_error_to_receive_error(field.error()));
+        if (request_data && request_data != parser.request_data()) {
+            request.move_views(request_data, request_length, parser.request_data());
         }
-        request.headers[std::move(header_name)] = *field;
     }
-
-    co_return request;
 }
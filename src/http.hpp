@@ -1,46 +1,89 @@
 #pragma once
 
 #include "common.hpp"
+#include <algorithm>
+#include <array>
+#include <bitset>
 #include <string>
 #include <string_view>
-#include <unordered_map>
 #include <vector>
 #include <chrono>
-#include <filesystem>
+#include <optional>
+#include <span>
 #include <tl/expected.hpp>
-#include <fmt/chrono.h>
+#include <boost/container/small_vector.hpp>
+#include "ring_buffer.hpp"
 
 extern const std::string_view UNKNOWN_STATUS;
 
-struct HttpResponseHeader {
-    u16 status = 200;
-    std::unordered_map<std::string, std::string> headers;
+// The prebuilt status line, like "HTTP/1.1 404 Not Found\r\n", or an empty
+// string for an unknown status
+std::string_view get_status_line(u16 status);
 
-    HttpResponseHeader() = default;
+// A buffer of fixed size for building response headers in, so building one
+// doesn't allocate. Whatever doesn't fit is dropped.
+struct HeaderBuffer {
+    static constexpr size_t CAPACITY = 2048;
 
-    std::string& operator[](const std::string& key) {
-        return headers[key];
-    }
-    std::string& operator[](std::string&& key) {
-        return headers[key];
-    }
+    std::array<char, CAPACITY> data;
+    size_t length = 0;
 
-    void set_content_length(size_t length);
-    void set_last_modified(const std::filesystem::file_time_type& time) {
-        using namespace std::chrono;
-        const auto system_time = time_point_cast<system_clock::duration>(time - std::filesystem::file_time_type::clock::now() + system_clock::now());
-        set_last_modified(system_time);
-    }
-    template<class T> void set_last_modified(const T& time) {
-        headers["Last-Modified"] = fmt::format("{:%a, %d %b %Y %H:%M:%S} GMT", std::chrono::floor<std::chrono::seconds>(time));
+    void append(std::string_view s) {
+        const auto n = std::min(s.size(), CAPACITY - length);
+        std::copy_n(s.data(), n, data.data() + length);
+        length += n;
     }
+    void append_number(u64 n);
+    void append_http_date(std::chrono::system_clock::time_point time);
+
+    void clear() { length = 0; }
+    std::string_view view() const { return std::string_view(data.data(), length); }
+};
+
+struct ByteRange {
+    u64 first = 0;
+    u64 length = 0;
+};
+using ByteRanges = boost::container::small_vector<ByteRange, 4>;
+
+// The header of a response, built into a HeaderBuffer with the fields in a
+// fixed order. The fields that depend only on the content come first, so a
+// cached file can have them built once, and then come Date and Connection,
+// which are built for every response.
+struct HttpResponseHeader {
+    u16 status = 200;
+    std::string_view content_type;
+    std::optional<u64> content_length;
+    std::optional<std::chrono::system_clock::time_point> last_modified;
+    // With the quotes
+    std::string_view etag;
+    bool accept_ranges = false;
+    // Content-Range is sent when complete_length is set: with the range of
+    // a 206 response, or as "*/length" without one, for a 416 response
+    std::optional<ByteRange> range;
+    std::optional<u64> complete_length;
+    bool close_connection = false;
 
-    const std::string_view& status_to_string() const;
-    std::string build() const;
+    std::string_view status_to_string() const;
 
-    static std::string build_error(u16 status);
+    // The status line, Server, Content-Type, Content-Length, Content-Range,
+    // Accept-Ranges, Last-Modified and ETag
+    void build_content_fields(HeaderBuffer& buffer) const;
+    // Date, Connection and the empty line ending the header. The Date is
+    // formatted at most once a second per thread.
+    static void build_response_fields(HeaderBuffer& buffer, bool close_connection);
+
+    void build(HeaderBuffer& buffer) const {
+        build_content_fields(buffer);
+        build_response_fields(buffer, close_connection);
+    }
 };
 
+// The buffers of a response whose content fields were built beforehand:
+// those, Date and Connection built into response_fields, and the body. They
+// are sent with one vectored write.
+std::array<asio::const_buffer, 3> prebuilt_response_buffers(std::string_view content_fields, HeaderBuffer& response_fields, bool close_connection, std::span<const char> body);
+
 #define LIST_OF_HTTP_METHODS(DO)\
     DO(GET)\
     DO(HEAD)\
@@ -60,17 +103,236 @@ enum class HttpMethod {
 extern const std::string_view INVALID_METHOD_STRING;
 const std::string_view& to_string(HttpMethod method);
 
+// The request headers the server looks at, or that browsers commonly send
+#define LIST_OF_KNOWN_HTTP_HEADERS(DO)\
+    DO(ACCEPT, "Accept")\
+    DO(ACCEPT_ENCODING, "Accept-Encoding")\
+    DO(ACCEPT_LANGUAGE, "Accept-Language")\
+    DO(AUTHORIZATION, "Authorization")\
+    DO(CACHE_CONTROL, "Cache-Control")\
+    DO(CONNECTION, "Connection")\
+    DO(CONTENT_LENGTH, "Content-Length")\
+    DO(CONTENT_TYPE, "Content-Type")\
+    DO(COOKIE, "Cookie")\
+    DO(EXPECT, "Expect")\
+    DO(HOST, "Host")\
+    DO(IF_MATCH, "If-Match")\
+    DO(IF_MODIFIED_SINCE, "If-Modified-Since")\
+    DO(IF_NONE_MATCH, "If-None-Match")\
+    DO(IF_RANGE, "If-Range")\
+    DO(IF_UNMODIFIED_SINCE, "If-Unmodified-Since")\
+    DO(ORIGIN, "Origin")\
+    DO(PRAGMA, "Pragma")\
+    DO(RANGE, "Range")\
+    DO(REFERER, "Referer")\
+    DO(TE, "TE")\
+    DO(TRANSFER_ENCODING, "Transfer-Encoding")\
+    DO(UPGRADE, "Upgrade")\
+    DO(USER_AGENT, "User-Agent")\
+
+#define HEADER_ENUM(id, name) id,
+enum class HttpHeaderId : u8 {
+    LIST_OF_KNOWN_HTTP_HEADERS(HEADER_ENUM)
+    UNKNOWN,
+};
+constexpr size_t KNOWN_HTTP_HEADER_COUNT = (size_t)HttpHeaderId::UNKNOWN;
+
+// Looks the name up case-insensitively with a perfect hash of the known names
+HttpHeaderId get_header_id(std::string_view name);
+
+struct HttpRequest;
+
+// Receives requests into a ring buffer and parses them with a synchronous
+// state machine. parse consumes the bytes received so far and says whether
+// the request is complete. When it isn't, the state and the position are
+// kept, so parsing resumes where it stopped once more bytes have arrived.
+struct HttpRequestParser {
+    static constexpr size_t MIN_BUFFER_LENGTH = 16*1024;
+    static constexpr size_t DEFAULT_MAX_BUFFER_LENGTH = 64*1024;
+    // The most bytes read from the connection at once. A token can be as
+    // long as the buffer allows.
+    static constexpr size_t RECEIVE_CHUNK_SIZE = 8*1024;
+
+    enum Error {
+        OK = 0,
+        CONNECTION_CLOSED,
+        TIMED_OUT,
+        PAYLOAD_TOO_LARGE,
+        SERVER_ERROR,
+        BAD_REQUEST,
+    };
+
+    enum class ParseResult {
+        DONE,
+        NEED_MORE,
+        BAD_REQUEST,
+        UNKNOWN_METHOD,
+        UNSUPPORTED_HTTP_VERSION,
+    };
+
+    enum class State {
+        REQUEST_START,
+        METHOD,
+        TARGET_START,
+        TARGET,
+        VERSION_START,
+        VERSION,
+        REQUEST_LINE_END,
+        HEADER_START,
+        HEADER_NAME,
+        HEADER_VALUE_START,
+        HEADER_VALUE,
+    };
+
+    asio::ip::tcp::socket& connection;
+    // Empty while there are no bytes of a request to hold, so an idle
+    // connection costs no buffer
+    RingBuffer b;
+    size_t p = 0, end = 0;
+    ssize_t token_start = -1;
+    // The bytes of the request being parsed are kept until it's complete,
+    // since the request refers to them
+    ssize_t request_start = -1;
+    // The buffer starts at MIN_BUFFER_LENGTH and doubles when the current
+    // token and the unread bytes don't leave room for more, up to this length
+    size_t max_buffer_length = DEFAULT_MAX_BUFFER_LENGTH;
+
+    State state = State::REQUEST_START;
+
+    explicit HttpRequestParser(asio::ip::tcp::socket& connection, size_t max_buffer_length = DEFAULT_MAX_BUFFER_LENGTH)
+        : connection(connection), max_buffer_length(std::max(max_buffer_length, MIN_BUFFER_LENGTH)) {}
+    HttpRequestParser(const HttpRequestParser&) = delete;
+    // Returns the buffer to the pool of the thread
+    ~HttpRequestParser();
+
+    static bool is_whitespace(char c) {
+        return c == ' ' || c == '\t';
+    }
+
+    static bool is_whitespace_or_line_break(char c) {
+        return is_whitespace(c) || c == '\r' || c == '\n';
+    }
+
+    awaitable<Error> ensure_data(size_t length);
+
+    // Waits for the first byte of a request. The peer closing the connection
+    // or the idle timer cancelling the read before that isn't an error.
+    // Without bytes left over from the previous request, the buffer is
+    // returned to the pool and the socket is waited on without one.
+    awaitable<Error> wait_for_request();
+
+    void normalize();
+    // Moves the live bytes, from the start of the request being parsed, or
+    // else the unread ones, to a buffer of the given length
+    Error resize_buffer(size_t length);
+    size_t live_start() const;
+    void shift_indices(size_t offset);
+
+    // The start of the request being parsed. The pointer changes when
+    // ensure_data moves the bytes.
+    const char* request_data() {
+        return request_start >= 0 ? &b[request_start] : nullptr;
+    }
+
+    bool empty() {
+        return p == end;
+    }
+
+    // Parses the bytes in [p, end) into the request
+    ParseResult parse(HttpRequest& request);
+
+    private:
+    template<char... Cs> bool scan();
+    bool skip_whitespace();
+    bool at_line_break();
+    std::string_view take_token();
+    bool take_request_target(HttpRequest& request);
+};
+
+
+struct HttpHeader {
+    HttpHeaderId id;
+    std::string_view name;
+    std::string_view value;
+};
+
+// A request, whose path and headers refer to the bytes of the request in the
+// parser's buffer. It's valid until the next call to receive with the parser.
 struct HttpRequest {
+    static constexpr size_t INLINE_HEADER_COUNT = 32;
+
     HttpMethod method;
-    std::string path;
-    std::unordered_map<std::string, std::string> headers;
+    // Percent-decoded in place and without dot-segments, so it's canonical.
+    // Starts with '/'.
+    std::string_view path;
+    // As sent, without the '?'
+    std::string_view query;
+    // As sent, without the '#'. Clients shouldn't send one, but some do.
+    std::string_view fragment;
+    boost::container::small_vector<HttpHeader, INLINE_HEADER_COUNT> headers;
+    // The values of the known headers, indexed by their id. A header that
+    // wasn't sent has a view without data, unlike a sent one with an empty
+    // value. When a header is sent more than once, the first value is kept
+    // here and its bit is set in repeated_headers. A list header, like
+    // Connection, then has its elements on every line. A repeated singleton
+    // header, like Host, makes the request a bad one.
+    std::array<std::string_view, KNOWN_HTTP_HEADER_COUNT> known_headers = {};
+    std::bitset<KNOWN_HTTP_HEADER_COUNT> repeated_headers;
+
+    std::string_view header(HttpHeaderId id) const {
+        return known_headers[(size_t)id];
+    }
+    bool has_header(HttpHeaderId id) const {
+        return known_headers[(size_t)id].data() != nullptr;
+    }
+    // Case-insensitive. Known headers are found by their id, the others by
+    // comparing the names in turn.
+    const std::string_view* find_header(std::string_view name) const;
+    bool wants_connection_close() const;
+    bool has_body() const;
+    // Whether the length of the body is ambiguous: Content-Length is invalid
+    // or sent along with Transfer-Encoding. Such a request must be answered
+    // with 400 and the connection closed, since its end can't be told (RFC
+    // 9112, 6.3). Content-Lengths with differing values fail parsing already.
+    bool has_invalid_framing() const;
+    // Whether If-None-Match, or else If-Modified-Since, says that the
+    // client's copy of a representation with the given strong ETag and last
+    // write time is current, so a 304 can be sent instead of it (RFC 9110, 13.2.2)
+    bool is_not_modified(std::string_view etag, std::chrono::system_clock::time_point last_modified) const;
+
+    static constexpr size_t MAX_RANGE_COUNT = 16;
+
+    enum class RangeResult {
+        // There's no Range, or it's ignored: the whole representation is sent
+        WHOLE,
+        PARTIAL,
+        UNSATISFIABLE,
+    };
+    // Reads the byte ranges of a GET request for a representation of size
+    // bytes (RFC 9110, 14.2). The ranges that start past the end are left
+    // out and the others are cut at the end, in the order requested. When
+    // some of them overlap or are adjacent, they are merged instead, in
+    // ascending order, so no byte is sent more than once. Range is ignored
+    // when it's invalid, when it asks for more than MAX_RANGE_COUNT ranges,
+    // or when If-Range doesn't match the strong ETag or the exact last
+    // write time.
+    RangeResult requested_ranges(u64 size, std::string_view etag, std::chrono::system_clock::time_point last_modified, ByteRanges& ranges) const;
 
     enum class ReceiveError {
+        CONNECTION_CLOSED,
+        TIMED_OUT,
         SERVER_ERROR,
         UNKNOWN_METHOD,
         UNSUPPORTED_HTTP_VERSION,
         BAD_REQUEST,
         PAYLOAD_TOO_LARGE,
     };
-    static awaitable<tl::expected<HttpRequest, ReceiveError>> receive(asio::ip::tcp::socket& connection);
+    
+    // Receives the next request on the parser's connection. Bytes received
+    // past the end of the request are kept in the parser for the next call.
+    static awaitable<tl::expected<HttpRequest, ReceiveError>> receive(HttpRequestParser& parser);
+
+    private:
+    // Points the views into the length bytes at from to the same bytes at to
+    void move_views(const char* from, size_t length, const char* to);
 };
@@ -1,13 +1,53 @@
+#include <array>
 #include <cstdlib>
 #include <limits>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 #include <fmt/core.h>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
 
 #include "common.hpp"
 #include "http.hpp"
 #include "file.hpp"
+#include "send_file.hpp"
+#include "file_io.hpp"
+#include "blocking_pool.hpp"
+#include "ring_buffer.hpp"
+#include "allocation_counter.hpp"
+#include "static_responses.hpp"
 
 const u16 DEFAULT_PORT = 3000;
 const char DEFAULT_FILE_FOLDER[] = "public";
+const auto DEFAULT_KEEP_ALIVE_TIMEOUT = std::chrono::seconds(5);
+const size_t DEFAULT_MAX_KEEP_ALIVE_REQUESTS = 1000;
+const size_t DEFAULT_WORKER_COUNT = 1;
+const size_t MAX_WORKER_COUNT = 1024;
+
+struct ServerConfig {
+    u16 port = DEFAULT_PORT;
+    const char* file_folder = DEFAULT_FILE_FOLDER;
+    std::chrono::seconds keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
+    size_t max_keep_alive_requests = DEFAULT_MAX_KEEP_ALIVE_REQUESTS;
+    size_t worker_count = DEFAULT_WORKER_COUNT;
+    size_t max_cache_size = FileCache::DEFAULT_MAX_CACHE_SIZE;
+    bool use_sendfile = true;
+    bool map_files = true;
+    size_t max_request_buffer_length = HttpRequestParser::DEFAULT_MAX_BUFFER_LENGTH;
+    size_t blocking_thread_count = BlockingPool::DEFAULT_THREAD_COUNT;
+    std::chrono::seconds stats_interval = std::chrono::seconds(0);
+    // A mime.types file, whose types are used before the built-in ones
+    const char* mime_types_path = nullptr;
+    // A file of fixed routes, answered with the responses given in it
+    const char* routes_path = nullptr;
+};
 
 const char DEFAULT_HTML_DOCUMENT[] =
 "<!DOCTYPE html>"
@@ -23,156 +63,358 @@ const char DEFAULT_HTML_DOCUMENT[] =
 "</html>"
 ;
 
-awaitable<void> handle_connection(asio::ip::tcp::socket socket, FileCache& file_cache) {
+#ifdef __linux__
+using tcp_cork = asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>;
+#endif
+
+// While corked, the socket holds back partial segments, so a header written
+// before a file is sent with sendfile goes out along with the start of the
+// file instead of in a segment of its own. Uncorking sends what's left.
+static void set_cork(asio::ip::tcp::socket& socket, bool cork) {
+#ifdef __linux__
     boost::system::error_code ec;
-    auto executor = co_await this_coro::executor;
+    socket.set_option(tcp_cork(cork), ec);
+#else
+    (void)socket;
+    (void)cork;
+#endif
+}
 
-    auto request = co_await HttpRequest::receive(socket);
-    if (!request) {
-        fmt::print(stderr, "Error while receiving the request: ");
-        u16 status;
-        switch (request.error()) {
-            using enum HttpRequest::ReceiveError;
-            case SERVER_ERROR:
-                fmt::print(stderr, "server error\n");
-                status = 500;
-                break;
-            case UNKNOWN_METHOD:
-                fmt::print(stderr, "unknown method\n");
-                status = 501;
-                break;
-            case UNSUPPORTED_HTTP_VERSION:
-                fmt::print(stderr, "unsupported HTTP version\n");
-                status = 505;
-                break;
-            case BAD_REQUEST:
-                fmt::print(stderr, "bad request\n");
-                status = 400;
-                break;
-            case PAYLOAD_TOO_LARGE:
-                fmt::print(stderr, "payload too large\n");
-                status = 413;
-                break;
-        }
-
-        auto response = HttpResponseHeader::build_error(status);
-        co_await async_write(socket, asio::buffer(response), RE(ec));
-        if (ec) {
-            fmt::print(stderr, "send: {}\n", ec.message());
-        }
-        co_return;
+static awaitable<boost::system::error_code> send_file_range(asio::ip::tcp::socket& socket, const OpenedFile& file, ByteRange range, bool use_sendfile) {
+    if (use_sendfile) {
+        co_return co_await send_file(socket, file, range.first, range.length);
     }
+    co_return co_await stream_file(socket, file, range.first, range.length);
+}
+
+// Sends the ranges of the file as a multipart/byteranges response (RFC 9110,
+// 14.6). A cached file is sent with one vectored write of slices of its
+// contents, and a file sent from the file system a range at a time.
+static awaitable<boost::system::error_code> send_multipart_ranges(asio::ip::tcp::socket& socket, const File& file, const OpenedFile* opened_file, const ByteRanges& ranges, bool close_connection, bool use_sendfile) {
+    boost::system::error_code ec;
+    const u64 size = opened_file ? opened_file->size : file.contents.size();
 
-    fmt::print("Method: {}\n", to_string(request->method));
-    fmt::print("Path: {}\n", request->path);
-    fmt::print("Headers:\n");
-    for (const auto& h : request->headers) {
-        fmt::print("{}: {}\n", h.first, h.second);
+    // A random boundary, which the contents are unlikely to have
+    thread_local std::mt19937_64 random_engine(std::random_device{}());
+    const auto boundary = fmt::format("{:016x}", random_engine());
+
+    std::vector<std::string> part_headers;
+    const auto end = fmt::format("\r\n--{}--\r\n", boundary);
+    u64 content_length = end.size();
+    for (const auto& range : ranges) {
+        part_headers.push_back(fmt::format("\r\n--{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n",
+            boundary, file.mime_type, range.first, range.first + range.length - 1, size));
+        content_length += part_headers.back().size() + range.length;
     }
 
+    const auto content_type = fmt::format("multipart/byteranges; boundary={}", boundary);
+    HttpResponseHeader h;
+    h.status = 206;
+    h.content_type = content_type;
+    h.content_length = content_length;
+    h.last_modified = file.last_write;
+    h.etag = file.etag;
+    h.close_connection = close_connection;
+    HeaderBuffer header;
+    h.build(header);
 
-    if (request->path == "/" || request->path == "/index.html") {
-        auto content_length = sizeof(DEFAULT_HTML_DOCUMENT) - 1;
-        HttpResponseHeader h;
-        h["Connection"] = "close";
-        h["Content-Type"] = "text/html";
-        h.set_content_length(content_length);
-        auto header = h.build();
-        co_await async_write(socket, asio::buffer(header), RE(ec));
-        if (ec) {
-            fmt::print(stderr, "send: {}\n", ec.message());
+    if (!opened_file) {
+        std::vector<asio::const_buffer> buffers;
+        buffers.push_back(asio::buffer(header.view()));
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            buffers.push_back(asio::buffer(part_headers[i]));
+            buffers.push_back(asio::buffer(file.contents.data() + ranges[i].first, ranges[i].length));
         }
-        co_await async_write(socket, asio::buffer(DEFAULT_HTML_DOCUMENT, content_length), RE(ec));
-        if (ec) {
-            fmt::print(stderr, "send: {}\n", ec.message());
+        buffers.push_back(asio::buffer(end));
+        co_await async_write(socket, buffers, RE(ec));
+        co_return ec;
+    }
+
+    set_cork(socket, true);
+    defer { set_cork(socket, false); };
+    co_await async_write(socket, asio::buffer(header.view()), RE(ec));
+    for (size_t i = 0; i < ranges.size() && !ec; ++i) {
+        co_await async_write(socket, asio::buffer(part_headers[i]), RE(ec));
+        if (!ec) {
+            ec = co_await send_file_range(socket, *opened_file, ranges[i], use_sendfile);
         }
-    } else {
-        const auto file_result = file_cache.get_or_read(request->path);
+    }
+    if (!ec) {
+        co_await async_write(socket, asio::buffer(end), RE(ec));
+    }
+    co_return ec;
+}
+
+awaitable<void> handle_connection(asio::ip::tcp::socket connection, FileCache& file_cache, const StaticResponses& static_responses, const ServerConfig& config) {
+    boost::system::error_code ec;
+    auto executor = co_await this_coro::executor;
 
-        if (!file_result) {
-            const auto& error = file_result.error();
+    // The idle timer's handler may run after this coroutine has returned, so it shares the socket
+    auto socket = std::make_shared<asio::ip::tcp::socket>(std::move(connection));
+    asio::steady_timer idle_timer(executor);
+    // Bumped when a request has been received. A handler that was already
+    // queued when the timer was cancelled sees that its wait is over and
+    // leaves the writes of the response and the next request alone.
+    auto idle_generation = std::make_shared<u64>(0);
 
-            u16 status = 500;
-            switch (error.type) {
-                using enum FileReadError::Type;
-                case OK:
+    // The parser lives as long as the connection, so bytes of pipelined
+    // requests received along with the previous one aren't lost. The requests
+    // are handled one at a time, which keeps the responses in order.
+    HttpRequestParser parser(*socket, config.max_request_buffer_length);
+
+    for (size_t request_count = 1; ; ++request_count) {
+        idle_timer.expires_after(config.keep_alive_timeout);
+        idle_timer.async_wait([socket, idle_generation, generation = *idle_generation](const boost::system::error_code& ec) {
+            if (!ec && *idle_generation == generation) socket->cancel();
+        });
+        const auto allocations_before_request = allocation_count();
+        auto request = co_await HttpRequest::receive(parser);
+        [[maybe_unused]] const auto allocations_while_receiving = allocation_count() - allocations_before_request;
+        ++*idle_generation;
+        idle_timer.cancel();
+
+        if (!request) {
+            u16 status;
+            switch (request.error()) {
+                using enum HttpRequest::ReceiveError;
+                case CONNECTION_CLOSED:
+                    co_return;
+                case TIMED_OUT:
+                    fmt::print(stderr, "Error while receiving the request: timed out\n");
+                    status = 408;
                     break;
-                case INVALID_URI:
-                    status = 400;
+                case SERVER_ERROR:
+                    fmt::print(stderr, "Error while receiving the request: server error\n");
+                    status = 500;
                     break;
-                case NOT_FOUND:
-                    status = 404;
+                case UNKNOWN_METHOD:
+                    fmt::print(stderr, "Error while receiving the request: unknown method\n");
+                    status = 501;
                     break;
-                case IO_ERROR:
-                    status = 500;
-                    if (error.message) {
-                        fmt::print(stderr, "IO error: {}\n", error.message);
-                    } else if (error.ec) {
-                        fmt::print(stderr, "IO error: {}\n", error.ec.message());
-                    } else {
-                        fmt::print(stderr, "Unknown IO error\n");
-                    }
+                case UNSUPPORTED_HTTP_VERSION:
+                    fmt::print(stderr, "Error while receiving the request: unsupported HTTP version\n");
+                    status = 505;
+                    break;
+                case BAD_REQUEST:
+                    fmt::print(stderr, "Error while receiving the request: bad request\n");
+                    status = 400;
+                    break;
+                case PAYLOAD_TOO_LARGE:
+                    fmt::print(stderr, "Error while receiving the request: payload too large\n");
+                    status = 413;
                     break;
             }
 
-            auto response = HttpResponseHeader::build_error(status);
-            co_await async_write(socket, asio::buffer(response), RE(ec));
+            HeaderBuffer response_fields;
+            co_await async_write(*socket, static_responses.error(status).buffers(response_fields, true, true), RE(ec));
             if (ec) {
                 fmt::print(stderr, "send: {}\n", ec.message());
             }
             co_return;
         }
 
-        const auto& file = file_result->get();
+        fmt::print("Method: {}\n", to_string(request->method));
+        fmt::print("Path: {}\n", request->path);
+        fmt::print("Headers:\n");
+        for (const auto& h : request->headers) {
+            fmt::print("{}: {}\n", h.name, h.value);
+        }
 
-        HttpResponseHeader h;
-        h["Connection"] = "close";
-        h["Content-Type"] = file.mime_type;
-        h.set_content_length(file.contents.size());
-        h.set_last_modified(file.last_write);
-        const auto header = h.build();
+        if (request->has_invalid_framing()) {
+            fmt::print(stderr, "Error while receiving the request: ambiguous body length\n");
+            HeaderBuffer response_fields;
+            co_await async_write(*socket, static_responses.error(400).buffers(response_fields, true, true), RE(ec));
+            if (ec) {
+                fmt::print(stderr, "send: {}\n", ec.message());
+            }
+            co_return;
+        }
 
-        co_await async_write(socket, asio::buffer(header), RE(ec));
-        if (ec) {
-            fmt::print(stderr, "send: {}\n", ec.message());
+        // Request bodies aren't read, so the connection can't be reused after a request with one
+        const bool keep_alive = request_count < config.max_keep_alive_requests
+            && !request->wants_connection_close()
+            && !request->has_body();
+        const bool send_body = request->method != HttpMethod::HEAD;
+
+        if (auto route = static_responses.find_route(request->path)) {
+            HeaderBuffer response_fields;
+            co_await async_write(*socket, route->buffers(response_fields, !keep_alive, send_body), RE(ec));
+            if (ec) {
+                fmt::print(stderr, "send: {}\n", ec.message());
+                co_return;
+            }
+        } else {
+            auto file_result = co_await file_cache.get_or_read(request->path);
+
+            // A client whose copy is current gets a 304 without the file being opened
+            const bool not_modified = file_result && request->is_not_modified((*file_result)->etag, (*file_result)->last_write);
+
+            // Files too large for the cache are opened only now and sent with their current size
+            std::optional<OpenedFile> opened_file;
+            if (file_result && !not_modified && (*file_result)->uncached_path) {
+                auto opened = co_await OpenedFile::open(*(*file_result)->uncached_path);
+                if (opened) {
+                    opened_file.emplace(std::move(*opened));
+                } else {
+                    file_result = tl::unexpected(opened.error());
+                }
+            }
+
+            if (!file_result) {
+                const auto& error = file_result.error();
+
+                u16 status = 500;
+                switch (error.type) {
+                    using enum FileReadError::Type;
+                    case OK:
+                        break;
+                    case INVALID_URI:
+                        status = 400;
+                        break;
+                    case NOT_FOUND:
+                        status = 404;
+                        break;
+                    case IO_ERROR:
+                        status = 500;
+                        if (error.message) {
+                            fmt::print(stderr, "IO error: {}\n", error.message);
+                        } else if (error.ec) {
+                            fmt::print(stderr, "IO error: {}\n", error.ec.message());
+                        } else {
+                            fmt::print(stderr, "Unknown IO error\n");
+                        }
+                        break;
+                }
+
+                HeaderBuffer response_fields;
+                co_await async_write(*socket, static_responses.error(status).buffers(response_fields, !keep_alive, send_body), RE(ec));
+                if (ec) {
+                    fmt::print(stderr, "send: {}\n", ec.message());
+                    co_return;
+                }
+            } else {
+                const auto& file = **file_result;
+                const u64 size = opened_file ? opened_file->size : file.contents.size();
+
+                ByteRanges ranges;
+                const auto range_result = not_modified ? HttpRequest::RangeResult::WHOLE : request->requested_ranges(size, file.etag, file.last_write, ranges);
+                // The whole file or the one range requested
+                const bool partial = ranges.size() == 1;
+                const auto body_range = partial ? ranges[0] : ByteRange{ 0, size };
+
+                HeaderBuffer header;
+                if (not_modified) {
+                    co_await async_write(*socket, prebuilt_response_buffers(file.not_modified_header, header, !keep_alive, {}), RE(ec));
+                } else if (range_result == HttpRequest::RangeResult::UNSATISFIABLE) {
+                    HttpResponseHeader h;
+                    h.status = 416;
+                    h.content_length = 0;
+                    h.complete_length = size;
+                    h.close_connection = !keep_alive;
+                    h.build(header);
+                    co_await async_write(*socket, asio::buffer(header.view()), RE(ec));
+                } else if (ranges.size() > 1) {
+                    ec = co_await send_multipart_ranges(*socket, file, opened_file ? &*opened_file : nullptr, ranges, !keep_alive, config.use_sendfile);
+                } else if (opened_file || partial) {
+                    HttpResponseHeader h;
+                    h.close_connection = !keep_alive;
+                    h.content_type = file.mime_type;
+                    h.content_length = body_range.length;
+                    if (partial) {
+                        h.status = 206;
+                        h.range = body_range;
+                        h.complete_length = size;
+                    } else {
+                        h.accept_ranges = true;
+                    }
+                    h.last_modified = file.last_write;
+                    h.etag = file.etag;
+                    h.build(header);
+
+                    if (opened_file) {
+                        set_cork(*socket, true);
+                        co_await async_write(*socket, asio::buffer(header.view()), RE(ec));
+                        if (!ec && send_body) {
+                            ec = co_await send_file_range(*socket, *opened_file, body_range, config.use_sendfile);
+                        }
+                        set_cork(*socket, false);
+                    } else {
+                        // A slice of the cached contents
+                        const std::array<asio::const_buffer, 2> buffers{
+                            asio::buffer(header.view()),
+                            asio::buffer(file.contents.subspan(body_range.first, body_range.length).data(), body_range.length),
+                        };
+                        co_await async_write(*socket, buffers, RE(ec));
+                    }
+                } else {
+                    // The content fields were built when the file was cached
+                    const auto body = send_body ? file.contents : file.contents.first(0);
+                    co_await async_write(*socket, prebuilt_response_buffers(file.header, header, !keep_alive, body), RE(ec));
+                }
+                if (ec) {
+                    fmt::print(stderr, "send: {}\n", ec.message());
+                    co_return;
+                }
+            }
         }
-        co_await async_write(socket, asio::buffer(file.contents), RE(ec));
-        if (ec) {
-            fmt::print(stderr, "send: {}\n", ec.message());
+
+#ifdef COUNT_ALLOCATIONS
+        fmt::print("Allocations: {} while receiving the request, {} in total\n",
+            allocations_while_receiving, allocation_count() - allocations_before_request);
+#endif
+
+        if (!keep_alive) {
+            socket->shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+            co_return;
         }
     }
 }
 
-awaitable<void> listener(u16 port, const char* file_folder) {
-    boost::system::error_code ec;
-    auto executor = co_await this_coro::executor;
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
 
-    FileCache file_cache(file_folder);
-    fmt::print("Serving files from {}\n", file_cache.file_root_path.string());
+tl::expected<asio::ip::tcp::acceptor, boost::system::error_code> open_acceptor(asio::io_context& io_context, const ServerConfig& config) {
+    boost::system::error_code ec;
+    const auto port = config.port;
 
     asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
-    asio::ip::tcp::acceptor acceptor(executor);
+    asio::ip::tcp::acceptor acceptor(io_context);
 
     acceptor.open(endpoint.protocol(), ec);
     if (ec) {
         fmt::print(stderr, "open on port {}: {}\n", port, ec.message());
-        co_return;
+        return tl::unexpected(ec);
     }
 
     asio::socket_base::reuse_address reuse_address(true);
     acceptor.set_option(reuse_address);
 
+    // Every worker binds its own acceptor to the same port and the kernel
+    // distributes the incoming connections between them
+    if (config.worker_count > 1) {
+        acceptor.set_option(reuse_port(true), ec);
+        if (ec) {
+            fmt::print(stderr, "SO_REUSEPORT on port {}: {}\n", port, ec.message());
+            return tl::unexpected(ec);
+        }
+    }
+
     acceptor.bind(endpoint, ec);
     if (ec) {
         fmt::print(stderr, "bind on port {}: {}\n", port, ec.message());
-        co_return;
+        return tl::unexpected(ec);
     }
     acceptor.listen(asio::socket_base::max_listen_connections, ec);
     if (ec) {
         fmt::print(stderr, "listen on port {}: {}\n", port, ec.message());
-        co_return;
+        return tl::unexpected(ec);
     }
-    fmt::print("Listening on port {}...\n", port);
+
+    return acceptor;
+}
+
+awaitable<void> listener(asio::ip::tcp::acceptor acceptor, FileCache& file_cache, const StaticResponses& static_responses, const ServerConfig& config) {
+    boost::system::error_code ec;
+    auto executor = co_await this_coro::executor;
 
     while (true) {
         auto socket = co_await acceptor.async_accept(RE(ec));
@@ -181,40 +423,194 @@ awaitable<void> listener(u16 port, const char* file_folder) {
             continue;
         }
 
+        // Responses are written whole, so Nagle's algorithm would only delay them
+        socket.set_option(asio::ip::tcp::no_delay(true), ec);
+
         auto remote_endpoint = socket.remote_endpoint(ec);
         if (!ec) {
             fmt::print("New connection from address: {}:{}\n", remote_endpoint.address().to_string(), remote_endpoint.port());
         }
 
-        co_spawn(executor, handle_connection(std::move(socket), file_cache), asio::redirect_error(detached, ec));
+        co_spawn(executor, handle_connection(std::move(socket), file_cache, static_responses, config), asio::redirect_error(detached, ec));
         if (ec) {
             fmt::print(stderr, "Error while handling connection: {}\n", ec.message());
         }
     }
 }
 
-int main(int argc, char** argv) {
+awaitable<void> report_stats(BlockingPool& blocking_pool, std::chrono::seconds interval) {
     boost::system::error_code ec;
+    asio::steady_timer timer(co_await this_coro::executor);
 
-    const auto port_env = std::getenv("PORT");
-    auto port = port_env ? strtoul(port_env, nullptr, 10) : std::numeric_limits<u32>::max();
-    if (port > std::numeric_limits<u16>::max()) {
-        port = DEFAULT_PORT;
-    }
+    while (true) {
+        timer.expires_after(interval);
+        co_await timer.async_wait(RE(ec));
+        if (ec) co_return;
 
-    auto file_folder = argc > 1 ? argv[1] : DEFAULT_FILE_FOLDER;
+        const auto pool = blocking_pool.stats();
+        fmt::print("Blocking pool: {}/{} threads busy, {} queued (max {}), {} completed, {} run on the calling thread\n",
+            pool.busy_threads, pool.thread_count, pool.queue_length, pool.max_queue_length, pool.completed, pool.rejected);
 
-    asio::io_context io_context(1);
-    co_spawn(io_context, listener(port, file_folder), asio::redirect_error(detached, ec));
-    if (ec) {
-        fmt::print(stderr, "Error while starting the listener: {}\n", ec.message());
-        return -1;
+        const auto buffers = RingBufferPool::total_stats();
+        fmt::print("Ring buffers: {} reused, {} created, {} free, {} trimmed\n",
+            buffers.hits, buffers.misses, buffers.free_buffers, buffers.trimmed);
     }
-    io_context.run(ec);
+}
+
+// Each worker thread runs its own event loop with its own acceptor, so a
+// connection stays on the thread that accepted it. Only the file cache is
+// shared between the workers.
+struct Worker {
+    asio::io_context io_context{1};
+    std::thread thread;
+};
+
+static int run_worker(Worker& worker) {
+    boost::system::error_code ec;
+    worker.io_context.run(ec);
     if (ec) {
         fmt::print(stderr, "Error: {}\n", ec.message());
         return -1;
     }
-
     return 0;
 }
+
+// Returns the value of the environment variable, if it's set to a number in [min, max]
+static std::optional<u64> get_env_number(const char* name, u64 min, u64 max) {
+    const auto env = std::getenv(name);
+    if (!env) return std::nullopt;
+
+    char* end = nullptr;
+    const auto value = strtoull(env, &end, 10);
+    if (end == env || *end != '\0' || value < min || value > max) {
+        fmt::print(stderr, "Ignoring invalid value for {}: {}\n", name, env);
+        return std::nullopt;
+    }
+    return value;
+}
+
+static std::optional<size_t> parse_worker_count(const char* value) {
+    char* end = nullptr;
+    const auto count = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || count < 1 || count > MAX_WORKER_COUNT) {
+        return std::nullopt;
+    }
+    return count;
+}
+
+static void print_usage(const char* program) {
+    fmt::print(stderr, "Usage: {} [-t|--threads <count>] [public directory]\n", program);
+}
+
+int main(int argc, char** argv) {
+    boost::system::error_code ec;
+
+    ServerConfig config;
+    config.port = get_env_number("PORT", 0, std::numeric_limits<u16>::max()).value_or(DEFAULT_PORT);
+    if (auto timeout = get_env_number("KEEP_ALIVE_TIMEOUT", 1, 24*60*60)) {
+        config.keep_alive_timeout = std::chrono::seconds(*timeout);
+    }
+    config.max_keep_alive_requests = get_env_number("MAX_KEEP_ALIVE_REQUESTS", 1, std::numeric_limits<size_t>::max()).value_or(DEFAULT_MAX_KEEP_ALIVE_REQUESTS);
+    config.worker_count = get_env_number("THREADS", 1, MAX_WORKER_COUNT).value_or(DEFAULT_WORKER_COUNT);
+    if (auto cache_size = get_env_number("CACHE_SIZE", 0, std::numeric_limits<size_t>::max() / FileCache::MEGABYTE)) {
+        config.max_cache_size = *cache_size * FileCache::MEGABYTE;
+    }
+    config.use_sendfile = get_env_number("SENDFILE", 0, 1).value_or(1);
+    config.map_files = get_env_number("MMAP", 0, 1).value_or(1);
+    if (auto header_size = get_env_number("MAX_HEADER_SIZE", HttpRequestParser::MIN_BUFFER_LENGTH / 1024, 64*1024)) {
+        config.max_request_buffer_length = *header_size * 1024;
+    }
+    config.blocking_thread_count = get_env_number("BLOCKING_THREADS", 0, MAX_WORKER_COUNT).value_or(BlockingPool::DEFAULT_THREAD_COUNT);
+    config.stats_interval = std::chrono::seconds(get_env_number("STATS_INTERVAL", 0, 24*60*60).value_or(0));
+    if (auto path = std::getenv("MIME_TYPES"); path && *path) {
+        config.mime_types_path = path;
+    }
+    if (auto path = std::getenv("ROUTES"); path && *path) {
+        config.routes_path = path;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "-t" || arg == "--threads") {
+            auto count = i + 1 < argc ? parse_worker_count(argv[++i]) : std::nullopt;
+            if (!count) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            config.worker_count = *count;
+        } else if (arg.starts_with('-')) {
+            print_usage(argv[0]);
+            return -1;
+        } else {
+            config.file_folder = argv[i];
+        }
+    }
+
+    // Destroyed in reverse order, so the blocking pool finishes its calls while the workers' io_contexts still exist
+    std::vector<std::unique_ptr<Worker>> workers;
+    BlockingPool blocking_pool(config.blocking_thread_count);
+
+    MimeTypes mime_types;
+    if (config.mime_types_path) {
+        auto loaded = MimeTypes::load(config.mime_types_path);
+        if (!loaded) {
+            fmt::print(stderr, "Error while loading the MIME types: {}\n", loaded.error());
+            return -1;
+        }
+        mime_types = std::move(*loaded);
+        fmt::print("Loaded {} MIME types from {}\n", mime_types.loaded_count(), config.mime_types_path);
+    }
+
+    StaticResponses static_responses;
+    static_responses.add_route("/", 200, "text/html", DEFAULT_HTML_DOCUMENT);
+    static_responses.add_route("/index.html", 200, "text/html", DEFAULT_HTML_DOCUMENT);
+    if (config.routes_path) {
+        auto count = static_responses.load_routes(config.routes_path);
+        if (!count) {
+            fmt::print(stderr, "Error while loading the routes: {}\n", count.error());
+            return -1;
+        }
+        fmt::print("Loaded {} routes from {}\n", *count, config.routes_path);
+    }
+
+    FileCache file_cache(config.file_folder, config.max_cache_size, &blocking_pool, config.map_files, std::move(mime_types));
+    fmt::print("Serving files from {}\n", file_cache.file_root_path.string());
+
+    for (size_t i = 0; i < config.worker_count; ++i) {
+        auto& worker = *workers.emplace_back(std::make_unique<Worker>());
+        asio::make_service<FileIo>(worker.io_context, &blocking_pool);
+
+        auto acceptor = open_acceptor(worker.io_context, config);
+        if (!acceptor) {
+            return -1;
+        }
+
+        co_spawn(worker.io_context, listener(std::move(*acceptor), file_cache, static_responses, config), asio::redirect_error(detached, ec));
+        if (ec) {
+            fmt::print(stderr, "Error while starting the listener: {}\n", ec.message());
+            return -1;
+        }
+    }
+    if (config.stats_interval.count()) {
+        co_spawn(workers[0]->io_context, report_stats(blocking_pool, config.stats_interval), detached);
+    }
+
+    const bool uses_io_uring = asio::use_service<FileIo>(workers[0]->io_context).uses_io_uring();
+    fmt::print("Reading files with {}\n", uses_io_uring ? "io_uring" : "the blocking pool");
+    fmt::print("Listening on port {} with {} thread{}...\n", config.port, config.worker_count, config.worker_count > 1 ? "s" : "");
+
+    // The main thread runs the first worker
+    for (size_t i = 1; i < workers.size(); ++i) {
+        workers[i]->thread = std::thread([&worker = *workers[i]] {
+            run_worker(worker);
+        });
+    }
+    auto result = run_worker(*workers[0]);
+
+    for (size_t i = 1; i < workers.size(); ++i) {
+        workers[i]->io_context.stop();
+        workers[i]->thread.join();
+    }
+
+    return result;
+}
@@ -0,0 +1,118 @@
+#include "mime_types.hpp"
+
+#include <bit>
+#include <cstring>
+#include "file.hpp"
+#include "perfect_hash.hpp"
+
+#define LIST_OF_BUILT_IN_MIME_TYPES(DO)\
+    DO("txt", "text/plain")\
+    DO("html", "text/html")\
+    DO("htm", "text/html")\
+    DO("js", "text/javascript")\
+    DO("mjs", "text/javascript")\
+    DO("css", "text/css")\
+    DO("json", "application/json")\
+    DO("xml", "application/xml")\
+    DO("pdf", "application/pdf")\
+    DO("wasm", "application/wasm")\
+    DO("jpeg", "image/jpeg")\
+    DO("jpg", "image/jpeg")\
+    DO("png", "image/png")\
+    DO("gif", "image/gif")\
+    DO("ico", "image/vnd.microsoft.icon")\
+    DO("svg", "image/svg+xml")\
+    DO("webp", "image/webp")\
+    DO("avif", "image/avif")\
+    DO("woff", "font/woff")\
+    DO("woff2", "font/woff2")\
+    DO("mp4", "video/mp4")\
+    DO("webm", "video/webm")\
+
+#define EXTENSION(extension, mime_type) extension,
+#define MIME_TYPE(extension, mime_type) mime_type,
+static constexpr std::string_view BUILT_IN_MIME_TYPES[] = {
+    LIST_OF_BUILT_IN_MIME_TYPES(MIME_TYPE)
+};
+static constexpr auto BUILT_IN_EXTENSIONS = std::to_array<std::string_view>({
+    LIST_OF_BUILT_IN_MIME_TYPES(EXTENSION)
+});
+static constexpr PerfectHashTable<6, BUILT_IN_EXTENSIONS.size()> BUILT_IN_TABLE(BUILT_IN_EXTENSIONS);
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+tl::expected<MimeTypes, std::string> MimeTypes::load(const char* path) {
+    auto contents = read_startup_file(path);
+    if (!contents) {
+        return tl::unexpected(contents.error());
+    }
+
+    MimeTypes ret;
+    ret.text = std::make_unique<char[]>(contents->size());
+    memcpy(ret.text.get(), contents->data(), contents->size());
+    const std::string_view text(ret.text.get(), contents->size());
+
+    // The words of every line: the MIME type, then its extensions
+    std::vector<Entry> entries;
+    for (size_t line_start = 0; line_start < text.size(); ) {
+        auto line_end = text.find('\n', line_start);
+        if (line_end == std::string_view::npos) line_end = text.size();
+        auto line = text.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+
+        line = line.substr(0, line.find('#'));
+        std::string_view mime_type;
+        for (size_t i = 0; i < line.size(); ) {
+            while (i < line.size() && is_space(line[i])) ++i;
+            const size_t word_start = i;
+            while (i < line.size() && !is_space(line[i])) ++i;
+            if (i == word_start) break;
+
+            const auto word = line.substr(word_start, i - word_start);
+            if (mime_type.empty()) {
+                mime_type = word;
+            } else {
+                entries.push_back({ word, mime_type });
+            }
+        }
+    }
+
+    ret.slots.resize(std::max<size_t>(std::bit_ceil(2*entries.size()), 16));
+    const size_t mask = ret.slots.size() - 1;
+    for (const auto& entry : entries) {
+        // The first type of an extension wins
+        for (size_t i = ret.first_slot(entry.extension); ; i = (i + 1) & mask) {
+            auto& slot = ret.slots[i];
+            if (slot.extension.empty()) {
+                slot = entry;
+                ++ret.count;
+                break;
+            }
+            if (ascii_iequals(slot.extension, entry.extension)) break;
+        }
+    }
+
+    return ret;
+}
+
+size_t MimeTypes::first_slot(std::string_view extension) const {
+    return ascii_lowercase_hash_slot(extension, std::countr_zero(slots.size()));
+}
+
+std::string_view MimeTypes::find(std::string_view extension) const {
+    if (extension.empty()) return DEFAULT_MIME_TYPE;
+
+    if (count) {
+        const size_t mask = slots.size() - 1;
+        for (size_t i = first_slot(extension); slots[i].extension.size(); i = (i + 1) & mask) {
+            if (ascii_iequals(slots[i].extension, extension)) return slots[i].mime_type;
+        }
+    }
+
+    if (auto i = BUILT_IN_TABLE.find(extension); i < BUILT_IN_EXTENSIONS.size()) {
+        return BUILT_IN_MIME_TYPES[i];
+    }
+    return DEFAULT_MIME_TYPE;
+}
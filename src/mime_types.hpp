@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common.hpp"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <tl/expected.hpp>
+
+const char DEFAULT_MIME_TYPE[] = "application/octet-stream";
+
+// Maps file extensions to MIME types, ignoring case. The built-in types are
+// in a perfect hash table made at compile time. The types loaded from a
+// mime.types file are put in an open-addressing table once, which is never
+// changed after, and are looked up before the built-in ones.
+struct MimeTypes {
+    // Only the built-in types
+    MimeTypes() = default;
+
+    // Reads a file in the format of /etc/mime.types: a MIME type and its
+    // extensions on each line, separated by whitespace, and comments starting with '#'
+    static tl::expected<MimeTypes, std::string> load(const char* path);
+
+    // The extension without the dot
+    std::string_view find(std::string_view extension) const;
+
+    size_t loaded_count() const { return count; }
+
+    private:
+    struct Entry {
+        std::string_view extension;
+        std::string_view mime_type;
+    };
+
+    size_t first_slot(std::string_view extension) const;
+
+    // The contents of the loaded file, which the entries point into
+    std::unique_ptr<char[]> text;
+    // A power of two number of slots, at most half of them used
+    std::vector<Entry> slots;
+    size_t count = 0;
+};
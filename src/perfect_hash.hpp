@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.hpp"
+#include <array>
+#include <string_view>
+
+constexpr char ascii_to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+constexpr bool ascii_iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_to_lower(a[i]) != ascii_to_lower(b[i])) return false;
+    }
+    return true;
+}
+
+// FNV-1a of the lowercased string
+constexpr u32 ascii_lowercase_hash(std::string_view s, u32 seed = 2166136261u) {
+    u32 hash = seed;
+    for (char c : s) {
+        hash = (hash ^ (u8)ascii_to_lower(c)) * 16777619u;
+    }
+    return hash;
+}
+
+// The slot of s in a hash table of 2^bits slots. It's the top bits of the
+// hash, since the low bits depend only on the low bits of the seed and the string.
+constexpr size_t ascii_lowercase_hash_slot(std::string_view s, size_t bits, u32 seed = 2166136261u) {
+    return ascii_lowercase_hash(s, seed) >> (32 - bits);
+}
+
+// A table of 2^BITS slots in which each of the N keys has a slot of its own,
+// built at compile time by trying seeds until no two keys collide. A lookup
+// hashes the string once and compares it case-insensitively with the only key
+// that can match.
+template<size_t BITS, size_t N>
+struct PerfectHashTable {
+    static constexpr size_t SIZE = size_t(1) << BITS;
+    static_assert(N < SIZE);
+
+    std::array<std::string_view, N> keys;
+    u32 seed = 2166136261u;
+    // The index of the key in every slot, or N
+    std::array<u16, SIZE> slots = {};
+
+    constexpr explicit PerfectHashTable(const std::array<std::string_view, N>& keys) : keys(keys) {
+        for (;; ++seed) {
+            slots.fill(N);
+            bool collided = false;
+            for (size_t i = 0; i < N && !collided; ++i) {
+                auto& slot = slots[slot_of(keys[i])];
+                collided = slot != N;
+                slot = i;
+            }
+            if (!collided) return;
+        }
+    }
+
+    constexpr size_t slot_of(std::string_view s) const {
+        return ascii_lowercase_hash_slot(s, BITS, seed);
+    }
+
+    // The index of the key equal to s, ignoring case, or N
+    constexpr size_t find(std::string_view s) const {
+        const size_t i = slots[slot_of(s)];
+        return i != N && ascii_iequals(s, keys[i]) ? i : N;
+    }
+};
@@ -1,7 +1,9 @@
 #include "ring_buffer.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <mutex>
 #include <sys/mman.h>
 #include <sys/errno.h>
 #include <fcntl.h>
@@ -21,7 +23,32 @@ RingBuffer::~RingBuffer() {
     }
 }
 
-tl::expected<RingBuffer, const char*> RingBuffer::create(const size_t wanted_length) {
+// memfd_create needs no name of its own, so unlike shm_open it can't collide
+// with another buffer, and there's nothing to unlink
+static int create_memory_fd(size_t length, RingBuffer::MemorySource source) {
+    int fd = -1;
+    switch (source) {
+        case RingBuffer::MemorySource::MEMFD:
+#ifdef __linux__
+            fd = memfd_create("ring-buffer", MFD_CLOEXEC);
+#else
+            errno = ENOSYS;
+#endif
+            break;
+        case RingBuffer::MemorySource::SHM_OPEN:
+            fd = shm_open_anon();
+            break;
+    }
+    if (fd != -1 && ftruncate(fd, length) != 0) {
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+tl::expected<RingBuffer, const char*> RingBuffer::create(const size_t wanted_length, MemorySource source) {
     RingBuffer ret;
 
     size_t page_count = wanted_length / PAGE_SIZE;
@@ -30,13 +57,10 @@ tl::expected<RingBuffer, const char*> RingBuffer::create(const size_t wanted_len
     }
     ret.length = page_count*PAGE_SIZE;
 
-    ret.memory_fd = shm_open_anon();
+    ret.memory_fd = create_memory_fd(ret.length, source);
     if (ret.memory_fd == -1) {
         return tl::unexpected(strerror(errno));
     }
-    if (ftruncate(ret.memory_fd, ret.length)) {
-        return tl::unexpected(strerror(errno));
-    }
 
     ret.buffer = (char*)mmap(NULL, COPY_COUNT*ret.length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (ret.buffer == MAP_FAILED) {
@@ -54,6 +78,81 @@ tl::expected<RingBuffer, const char*> RingBuffer::create(const size_t wanted_len
     return ret;
 }
 
+static std::mutex pools_mutex;
+static std::vector<RingBufferPool*> pools;
+
+RingBufferPool::RingBufferPool() {
+    std::lock_guard lock(pools_mutex);
+    pools.push_back(this);
+}
+
+RingBufferPool::~RingBufferPool() {
+    std::lock_guard lock(pools_mutex);
+    std::erase(pools, this);
+}
+
+RingBufferPool& RingBufferPool::local() {
+    thread_local RingBufferPool pool;
+    return pool;
+}
+
+RingBufferPool::Stats RingBufferPool::total_stats() {
+    std::lock_guard lock(pools_mutex);
+
+    Stats ret;
+    for (auto pool : pools) {
+        ret.free_buffers += pool->free_count.load(std::memory_order_relaxed);
+        ret.hits += pool->hits.load(std::memory_order_relaxed);
+        ret.misses += pool->misses.load(std::memory_order_relaxed);
+        ret.trimmed += pool->trimmed.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+tl::expected<RingBuffer, const char*> RingBufferPool::acquire(size_t wanted_length) {
+    maybe_trim();
+
+    const size_t length = (wanted_length + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    auto search = std::find_if(free_buffers.rbegin(), free_buffers.rend(), [&](const RingBuffer& b) { return b.length == length; });
+    if (search == free_buffers.rend()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return RingBuffer::create(wanted_length);
+    }
+
+    auto ret = std::move(*search);
+    free_buffers.erase(std::next(search).base());
+    min_free_buffers = std::min(min_free_buffers, free_buffers.size());
+
+    hits.fetch_add(1, std::memory_order_relaxed);
+    free_count.store(free_buffers.size(), std::memory_order_relaxed);
+    return ret;
+}
+
+void RingBufferPool::release(RingBuffer&& buffer) {
+    if (buffer.buffer && free_buffers.size() < MAX_FREE_BUFFERS) {
+        free_buffers.push_back(std::move(buffer));
+        free_count.store(free_buffers.size(), std::memory_order_relaxed);
+    }
+    maybe_trim();
+}
+
+void RingBufferPool::maybe_trim() {
+    if (Clock::now() - last_trim >= TRIM_INTERVAL) {
+        trim();
+    }
+}
+
+void RingBufferPool::trim() {
+    // The buffers that were never needed during the interval, rounded up so the last one goes too
+    const auto count = (min_free_buffers + 1) / 2;
+    free_buffers.erase(free_buffers.begin(), free_buffers.begin() + count);
+
+    trimmed.fetch_add(count, std::memory_order_relaxed);
+    free_count.store(free_buffers.size(), std::memory_order_relaxed);
+    min_free_buffers = free_buffers.size();
+    last_trim = Clock::now();
+}
+
 
 // https://github.com/lassik/shm_open_anon/blob/master/shm_open_anon.c
 //
@@ -112,4 +211,3 @@ shm_open_anon(void)
 	}
 	return -1;
 }
-
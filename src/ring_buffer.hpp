@@ -1,7 +1,11 @@
 #pragma once
 
 #include "common.hpp"
+#include <atomic>
+#include <chrono>
 #include <type_traits>
+#include <utility>
+#include <vector>
 #include <tl/expected.hpp>
 
 extern const size_t PAGE_SIZE;
@@ -9,18 +13,35 @@ extern const size_t PAGE_SIZE;
 struct RingBuffer {
     static constexpr size_t COPY_COUNT = 3;
 
+    // Where the memory mapped into the copies comes from. memfd_create is
+    // only on Linux, and elsewhere an unlinked shm_open object is used.
+    enum class MemorySource {
+        MEMFD,
+        SHM_OPEN,
+    };
+#ifdef __linux__
+    static constexpr auto DEFAULT_MEMORY_SOURCE = MemorySource::MEMFD;
+#else
+    static constexpr auto DEFAULT_MEMORY_SOURCE = MemorySource::SHM_OPEN;
+#endif
+
     size_t length = 0;
     int memory_fd = -1;
     char* buffer = nullptr;
 
-    private:
+    // An empty buffer, which holds no memory
     RingBuffer() = default;
-    public:
     RingBuffer(const RingBuffer&) = delete;
     RingBuffer(RingBuffer&& o) : length(o.length), memory_fd(o.memory_fd), buffer(o.buffer) {
         o.memory_fd = -1;
         o.buffer = nullptr;
     }
+    RingBuffer& operator=(RingBuffer&& o) {
+        std::swap(length, o.length);
+        std::swap(memory_fd, o.memory_fd);
+        std::swap(buffer, o.buffer);
+        return *this;
+    }
     ~RingBuffer();
 
     template<typename T>
@@ -47,5 +68,53 @@ struct RingBuffer {
         return i;
     }
 
-    static tl::expected<RingBuffer, const char*> create(const size_t wanted_length = PAGE_SIZE);
+    static tl::expected<RingBuffer, const char*> create(const size_t wanted_length = PAGE_SIZE, MemorySource source = DEFAULT_MEMORY_SOURCE);
+};
+
+// Ring buffers kept for reuse by the connections of one thread, since
+// creating one takes about ten system calls. A connection stays on the
+// thread that accepted it, so a buffer acquired from local() is released to
+// the same pool, without a lock. At most MAX_FREE_BUFFERS are
+// kept, and when the pool is used after TRIM_INTERVAL has passed, it frees
+// half of the buffers that stayed unused for the whole interval.
+struct RingBufferPool {
+    static constexpr size_t MAX_FREE_BUFFERS = 64;
+    static constexpr auto TRIM_INTERVAL = std::chrono::seconds(10);
+
+    struct Stats {
+        size_t free_buffers = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t trimmed = 0;
+    };
+
+    RingBufferPool();
+    RingBufferPool(const RingBufferPool&) = delete;
+    ~RingBufferPool();
+
+    // Reuses a free buffer of the same length, or creates one
+    tl::expected<RingBuffer, const char*> acquire(size_t wanted_length);
+    void release(RingBuffer&& buffer);
+    void trim();
+
+    // The pool of the calling thread
+    static RingBufferPool& local();
+    // The sums of the stats of every thread's pool
+    static Stats total_stats();
+
+    private:
+    using Clock = std::chrono::steady_clock;
+
+    void maybe_trim();
+
+    std::vector<RingBuffer> free_buffers;
+    // The fewest free buffers since the last trim
+    size_t min_free_buffers = 0;
+    Clock::time_point last_trim = Clock::now();
+
+    // Read by other threads through total_stats
+    std::atomic<size_t> free_count = 0;
+    std::atomic<size_t> hits = 0;
+    std::atomic<size_t> misses = 0;
+    std::atomic<size_t> trimmed = 0;
 };
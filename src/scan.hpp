@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.hpp"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Returns the first of the characters Cs in [begin, end), or end. The bytes
+// are compared 16 at a time with SSE2, which every x86-64 CPU has, and 32 at a
+// time when compiled with AVX2 enabled. Elsewhere they are compared one at a
+// time. No byte at or after end is read, so end can be the end of a mapping.
+template<char... Cs>
+inline const char* scan_for(const char* begin, const char* end) {
+    const char* p = begin;
+
+#if defined(__AVX2__)
+    while (end - p >= 32) {
+        const auto bytes = _mm256_loadu_si256((const __m256i*)p);
+        auto matches = _mm256_setzero_si256();
+        ((matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(Cs)))), ...);
+
+        if (const u32 mask = _mm256_movemask_epi8(matches)) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+        const auto bytes = _mm_loadu_si128((const __m128i*)p);
+        auto matches = _mm_setzero_si128();
+        ((matches = _mm_or_si128(matches, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(Cs)))), ...);
+
+        if (const u32 mask = _mm_movemask_epi8(matches)) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+
+    while (p < end && ((*p != Cs) && ...)) {
+        ++p;
+    }
+    return p;
+}
+
+// Returns the first control character (below 0x20, or DEL) in [begin, end), or end
+inline const char* scan_for_control_character(const char* begin, const char* end) {
+    const char* p = begin;
+
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+        const auto bytes = _mm_loadu_si128((const __m128i*)p);
+        // Unsigned bytes below 0x20 are left unchanged by the minimum with 0x1f
+        const auto below_space = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(0x1f)), bytes);
+        const auto matches = _mm_or_si128(below_space, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x7f)));
+
+        if (const u32 mask = _mm_movemask_epi8(matches)) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+
+    while (p < end && (u8)*p >= 0x20 && *p != 0x7f) {
+        ++p;
+    }
+    return p;
+}
@@ -0,0 +1,140 @@
+#include "send_file.hpp"
+#include "file_io.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+OpenedFile::~OpenedFile() {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+awaitable<tl::expected<OpenedFile, FileReadError>> OpenedFile::open(const std::filesystem::path& path) {
+    auto& io = FileIo::of(co_await this_coro::executor);
+    OpenedFile ret;
+
+    auto fd = co_await io.open(path.c_str());
+    if (fd < 0) {
+        auto type = fd == -ENOENT || fd == -ENOTDIR ? FileReadError::NOT_FOUND : FileReadError::IO_ERROR;
+        co_return tl::unexpected(FileReadError{ type, {}, strerror(-fd) });
+    }
+    ret.fd = fd;
+
+    FileIo::Stat stat;
+    if (auto error = co_await io.stat(ret.fd, stat); error < 0) {
+        co_return tl::unexpected(FileReadError{ FileReadError::IO_ERROR, {}, strerror(-error) });
+    }
+    if (!stat.is_regular_file) {
+        co_return tl::unexpected(FileReadError{ FileReadError::NOT_FOUND });
+    }
+    ret.size = stat.size;
+
+    co_return ret;
+}
+
+// Free blocks of the thread for stream_file, per thread like RingBufferPool
+struct BlockPool {
+    static constexpr size_t MAX_FREE_BLOCKS = 16;
+
+    using Block = std::unique_ptr<char[]>;
+    std::vector<Block> free_blocks;
+
+    Block acquire() {
+        if (free_blocks.empty()) {
+            return Block(new char[STREAM_BLOCK_SIZE]);
+        }
+        auto block = std::move(free_blocks.back());
+        free_blocks.pop_back();
+        return block;
+    }
+
+    void release(Block&& block) {
+        if (block && free_blocks.size() < MAX_FREE_BLOCKS) {
+            free_blocks.push_back(std::move(block));
+        }
+    }
+
+    static BlockPool& local() {
+        thread_local BlockPool pool;
+        return pool;
+    }
+};
+
+awaitable<boost::system::error_code> stream_file(asio::ip::tcp::socket& socket, const OpenedFile& file, u64 offset, u64 length) {
+    boost::system::error_code ec;
+    auto& io = FileIo::of(co_await this_coro::executor);
+
+    auto& pool = BlockPool::local();
+    auto block = pool.acquire();
+    defer { pool.release(std::move(block)); };
+
+    while (length) {
+        auto read_bytes = co_await io.read(file.fd, block.get(), std::min<u64>(length, STREAM_BLOCK_SIZE), offset);
+        if (read_bytes == -EINTR) continue;
+        if (read_bytes < 0) {
+            co_return boost::system::error_code(-read_bytes, boost::system::system_category());
+        }
+        if (read_bytes == 0) {
+            // The file was truncated while it was being sent
+            co_return asio::error::eof;
+        }
+
+        co_await async_write(socket, asio::buffer(block.get(), read_bytes), RE(ec));
+        if (ec) co_return ec;
+
+        offset += read_bytes;
+        length -= read_bytes;
+    }
+
+    co_return ec;
+}
+
+#ifdef __linux__
+
+// Bounds the bytes sent in one go, so a fast client doesn't starve the other connections
+static constexpr size_t MAX_SEND_CHUNK_SIZE = 1024*1024;
+
+awaitable<boost::system::error_code> send_file(asio::ip::tcp::socket& socket, const OpenedFile& file, u64 offset, u64 length) {
+    boost::system::error_code ec;
+
+    socket.native_non_blocking(true, ec);
+    if (ec) co_return ec;
+
+    off_t file_offset = offset;
+    while (length) {
+        co_await socket.async_wait(asio::ip::tcp::socket::wait_write, RE(ec));
+        if (ec) co_return ec;
+
+        auto sent = sendfile(socket.native_handle(), file.fd, &file_offset, std::min<u64>(length, MAX_SEND_CHUNK_SIZE));
+        if (sent > 0) {
+            length -= sent;
+        } else if (sent == 0) {
+            // The file was truncated while it was being sent
+            co_return asio::error::eof;
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            // The file system doesn't support sendfile
+            co_return co_await stream_file(socket, file, file_offset, length);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            co_return boost::system::error_code(errno, boost::system::system_category());
+        }
+    }
+
+    co_return ec;
+}
+
+#else
+
+awaitable<boost::system::error_code> send_file(asio::ip::tcp::socket& socket, const OpenedFile& file, u64 offset, u64 length) {
+    return stream_file(socket, file, offset, length);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "common.hpp"
+#include <filesystem>
+#include <tl/expected.hpp>
+#include "file.hpp"
+
+// A file opened for sending it straight from the file system
+struct OpenedFile {
+    int fd = -1;
+    u64 size = 0;
+
+    OpenedFile() = default;
+    OpenedFile(const OpenedFile&) = delete;
+    OpenedFile(OpenedFile&& o) : fd(o.fd), size(o.size) {
+        o.fd = -1;
+    }
+    ~OpenedFile();
+
+    // Opens the file with the FileIo of the current executor
+    static awaitable<tl::expected<OpenedFile, FileReadError>> open(const std::filesystem::path& path);
+};
+
+// Sends length bytes of the file starting from offset. On Linux the bytes are
+// copied to the socket by the kernel with sendfile(2) whenever the socket is
+// writable, so the memory used doesn't depend on the size of the file. Where
+// sendfile isn't available, the file is streamed with stream_file.
+awaitable<boost::system::error_code> send_file(asio::ip::tcp::socket& socket, const OpenedFile& file, u64 offset, u64 length);
+
+// Sends the file like send_file, but reads it in blocks of
+// STREAM_BLOCK_SIZE bytes. A block is written to the socket before the next
+// one is read, so a slow client only holds one block. The blocks are reused
+// between the transfers of a thread.
+awaitable<boost::system::error_code> stream_file(asio::ip::tcp::socket& socket, const OpenedFile& file, u64 offset, u64 length);
+
+constexpr size_t STREAM_BLOCK_SIZE = 64*1024;
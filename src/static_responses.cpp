@@ -0,0 +1,90 @@
+#include "static_responses.hpp"
+
+#include <charconv>
+#include <fmt/format.h>
+#include "file.hpp"
+
+static StaticResponse build_static_response(u16 status, std::string_view content_type, std::string_view body) {
+    HttpResponseHeader h;
+    h.status = status;
+    h.content_type = content_type;
+    h.content_length = body.size();
+    HeaderBuffer header;
+    h.build_content_fields(header);
+    return StaticResponse{ std::string(header.view()), std::string(body) };
+}
+
+StaticResponses::StaticResponses() {
+    for (u16 status = MIN_ERROR_STATUS; status <= MAX_ERROR_STATUS; ++status) {
+        HttpResponseHeader h;
+        h.status = status;
+        errors[status - MIN_ERROR_STATUS] = build_static_response(status, "text/html", h.status_to_string());
+    }
+}
+
+// Responses with 1xx statuses, 204 and 304 end with the header (RFC 9112,
+// 6.3), so a body sent with one would be read as the next response
+static bool status_allows_body(u16 status) {
+    return status >= 200 && status != 204 && status != 304;
+}
+
+void StaticResponses::add_route(std::string_view path, u16 status, std::string_view content_type, std::string_view body) {
+    assert(status_allows_body(status));
+    routes.insert_or_assign(std::string(path), build_static_response(status, content_type, body));
+}
+
+static std::string_view trim(std::string_view s) {
+    const auto start = s.find_first_not_of(" \t\r");
+    if (start == std::string_view::npos) return {};
+    return s.substr(start, s.find_last_not_of(" \t\r") + 1 - start);
+}
+
+// Takes the first word of s
+static std::string_view take_word(std::string_view& s) {
+    s = trim(s);
+    const auto word = s.substr(0, s.find_first_of(" \t"));
+    s.remove_prefix(word.size());
+    return word;
+}
+
+tl::expected<size_t, std::string> StaticResponses::load_routes(const char* path) {
+    auto contents = read_startup_file(path);
+    if (!contents) {
+        return tl::unexpected(contents.error());
+    }
+
+    size_t count = 0;
+    const std::string_view text = *contents;
+    size_t line_number = 0;
+    for (size_t line_start = 0; line_start < text.size(); ) {
+        auto line_end = text.find('\n', line_start);
+        if (line_end == std::string_view::npos) line_end = text.size();
+        auto line = trim(text.substr(line_start, line_end - line_start));
+        line_start = line_end + 1;
+        ++line_number;
+
+        if (line.empty() || line[0] == '#') continue;
+
+        const auto route_path = take_word(line);
+        const auto status_string = take_word(line);
+        const auto body = trim(line);
+
+        u16 status = 0;
+        const auto result = std::from_chars(status_string.data(), status_string.data() + status_string.size(), status);
+        if (route_path[0] != '/' || result.ec != std::errc() || result.ptr != status_string.data() + status_string.size() || get_status_line(status).empty()) {
+            return tl::unexpected(fmt::format("{}:{}: expected a path starting with '/' and a known status", path, line_number));
+        }
+        if (!status_allows_body(status)) {
+            return tl::unexpected(fmt::format("{}:{}: a response with status {} can't have a body", path, line_number, status));
+        }
+
+        add_route(route_path, status, "text/plain", body);
+        ++count;
+    }
+    return count;
+}
+
+const StaticResponse* StaticResponses::find_route(std::string_view path) const {
+    auto search = routes.find(path);
+    return search != routes.end() ? &search->second : nullptr;
+}
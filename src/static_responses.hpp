@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.hpp"
+#include <array>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <tl/expected.hpp>
+#include "http.hpp"
+
+// A response whose bytes never change, built once
+struct StaticResponse {
+    // The status line and the content fields of the header
+    std::string header;
+    std::string body;
+
+    // The buffers to send, with Date and Connection built into response_fields
+    std::array<asio::const_buffer, 3> buffers(HeaderBuffer& response_fields, bool close_connection, bool send_body) const {
+        return prebuilt_response_buffers(header, response_fields, close_connection, std::span(body.data(), send_body ? body.size() : 0));
+    }
+};
+
+// The responses built at startup: one for every error status, with the
+// reason phrase as the body, and the fixed routes, which are answered
+// before the file cache is looked at. Nothing is changed once the workers
+// have started.
+struct StaticResponses {
+    static constexpr u16 MIN_ERROR_STATUS = 400;
+    static constexpr u16 MAX_ERROR_STATUS = 599;
+
+    StaticResponses();
+    StaticResponses(const StaticResponses&) = delete;
+
+    // Replaces the route with the same path, if there's one. The status must
+    // allow a body, so not 1xx, 204 or 304.
+    void add_route(std::string_view path, u16 status, std::string_view content_type, std::string_view body);
+
+    // Reads routes from a file with a route on each line: the path, the
+    // status and the rest of the line as a text/plain body. Lines starting
+    // with '#' are comments. Statuses whose responses have no body, 1xx, 204
+    // and 304, are rejected. Returns the number of routes read.
+    tl::expected<size_t, std::string> load_routes(const char* path);
+
+    const StaticResponse* find_route(std::string_view path) const;
+
+    // The status must be from MIN_ERROR_STATUS to MAX_ERROR_STATUS
+    const StaticResponse& error(u16 status) const {
+        assert(status >= MIN_ERROR_STATUS && status <= MAX_ERROR_STATUS);
+        return errors[status - MIN_ERROR_STATUS];
+    }
+
+    private:
+    struct PathHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view path) const { return std::hash<std::string_view>{}(path); }
+    };
+
+    std::array<StaticResponse, MAX_ERROR_STATUS - MIN_ERROR_STATUS + 1> errors;
+    std::unordered_map<std::string, StaticResponse, PathHash, std::equal_to<>> routes;
+};
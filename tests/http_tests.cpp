@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+
+#include "common.hpp"
+#include "http.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) do {\
+    if (!(condition)) {\
+        fmt::print(stderr, "{}:{}: check failed: {}\n", __FILE__, __LINE__, #condition);\
+        ++failures;\
+    }\
+} while (0)
+
+// Parses a request from bytes put straight into the parser's buffer, without a connection
+struct ParsedRequest {
+    asio::io_context io_context;
+    asio::ip::tcp::socket socket{io_context};
+    HttpRequestParser parser{socket};
+    HttpRequest request;
+    HttpRequestParser::ParseResult result;
+
+    explicit ParsedRequest(std::string_view text) {
+        parser.b = std::move(*RingBufferPool::local().acquire(HttpRequestParser::MIN_BUFFER_LENGTH));
+        memcpy(&parser.b[0], text.data(), text.size());
+        parser.end = text.size();
+        result = parser.parse(request);
+    }
+
+    bool done() const {
+        return result == HttpRequestParser::ParseResult::DONE;
+    }
+};
+
+static void test_framing() {
+    {
+        ParsedRequest r("GET / HTTP/1.1\r\nContent-Length: 5\r\n\r\n");
+        CHECK(r.done());
+        CHECK(!r.request.has_invalid_framing());
+        CHECK(r.request.has_body());
+    }
+    {
+        ParsedRequest r("GET / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n");
+        CHECK(r.done());
+        CHECK(!r.request.has_invalid_framing());
+    }
+    {
+        // The body of the first request would be parsed as the second one
+        ParsedRequest r("POST / HTTP/1.1\r\nContent-Length: 0\r\nContent-Length: 37\r\n\r\n"
+            "GET /secret HTTP/1.1\r\nHost: x\r\n\r\n");
+        CHECK(r.result == HttpRequestParser::ParseResult::BAD_REQUEST);
+    }
+    {
+        ParsedRequest r("POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n");
+        CHECK(r.done());
+        CHECK(r.request.has_invalid_framing());
+    }
+    {
+        ParsedRequest r("POST / HTTP/1.1\r\nContent-Length: +5\r\n\r\n");
+        CHECK(r.done());
+        CHECK(r.request.has_invalid_framing());
+    }
+    {
+        ParsedRequest r("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+        CHECK(r.done());
+        CHECK(!r.request.has_invalid_framing());
+        CHECK(r.request.has_body());
+    }
+}
+
+static bool is_bad_request(std::string_view text) {
+    ParsedRequest r(text);
+    return r.result == HttpRequestParser::ParseResult::BAD_REQUEST;
+}
+
+static void test_malformed_header_lines() {
+    // A line without a colon mustn't hide the Content-Length after it
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nFoo\r\nContent-Length: 5\r\n\r\nhello"));
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nFoo\nContent-Length: 5\r\n\r\nhello"));
+    // obs-fold
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nHost: x\r\n Content-Length: 5\r\n\r\nhello"));
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nHost: x\r\n\tContent-Length: 5\r\n\r\nhello"));
+    // Names must be tokens
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nContent Length: 5\r\n\r\nhello"));
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nContent-Length : 5\r\n\r\nhello"));
+    CHECK(is_bad_request("GET / HTTP/1.1\r\n: x\r\n\r\n"));
+    CHECK(is_bad_request("GET / HTTP/1.1\r\nX(y): x\r\n\r\n"));
+    // CR, LF or NUL inside a value
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nX: a\nContent-Length: 5\r\n\r\nhello"));
+    CHECK(is_bad_request("POST / HTTP/1.1\r\nX: a\rContent-Length: 5\r\n\r\nhello"));
+    CHECK(is_bad_request(std::string_view("GET / HTTP/1.1\r\nX: a\0b\r\n\r\n", 26)));
+
+    ParsedRequest r("GET / HTTP/1.1\r\nX-Token_Chars!#$%&'*+.^`|~: ok\r\n\r\n");
+    CHECK(r.done());
+    CHECK(r.request.find_header("x-token_chars!#$%&'*+.^`|~") != nullptr);
+}
+
+// The path of a request with the target, or nothing when it's a bad request
+static std::string path_of(std::string_view target) {
+    ParsedRequest r(fmt::format("GET {} HTTP/1.1\r\n\r\n", target));
+    if (!r.done()) {
+        CHECK(r.result == HttpRequestParser::ParseResult::BAD_REQUEST);
+        return "<bad request>";
+    }
+    CHECK(r.request.path.starts_with('/'));
+    return std::string(r.request.path);
+}
+
+static void test_request_targets() {
+    CHECK(path_of("/") == "/");
+    CHECK(path_of("/a/b.html") == "/a/b.html");
+
+    // Dot-segments
+    CHECK(path_of("/a/./b/../c") == "/a/c");
+    CHECK(path_of("/a/b/..") == "/a/");
+    CHECK(path_of("/a/.") == "/a/");
+    CHECK(path_of("/a/..b/.c") == "/a/..b/.c");
+    CHECK(path_of("/../../etc/passwd") == "/etc/passwd");
+    CHECK(path_of("/a/../../../etc/passwd") == "/etc/passwd");
+    CHECK(path_of("/..") == "/");
+
+    // Percent-encoding, which is decoded before the dot-segments are removed
+    CHECK(path_of("/a%20b") == "/a b");
+    CHECK(path_of("/%41%7a") == "/Az");
+    CHECK(path_of("/a/.%2e/b") == "/b");
+    CHECK(path_of("/a/%2E%2E/%2e%2e/etc/passwd") == "/etc/passwd");
+    CHECK(path_of("/a%2f..%2f..%2fetc") == "/etc");
+    CHECK(path_of("/%00") == "<bad request>");
+    CHECK(path_of("/a%00.html") == "<bad request>");
+    CHECK(path_of("/%2") == "<bad request>");
+    CHECK(path_of("/%") == "<bad request>");
+    CHECK(path_of("/%zz") == "<bad request>");
+    CHECK(path_of("/%g0") == "<bad request>");
+    // The decoded path must still start with '/'
+    CHECK(path_of("%2fa") == "<bad request>");
+    CHECK(path_of("%2e%2e/a") == "<bad request>");
+    CHECK(path_of("a/b") == "<bad request>");
+
+    // Control bytes
+    CHECK(path_of("/a\x01b") == "<bad request>");
+    CHECK(path_of("/a\x7f") == "<bad request>");
+    CHECK(is_bad_request(std::string_view("GET /a\0b HTTP/1.1\r\n\r\n", 21)));
+
+    // The query and the fragment are split off before decoding
+    {
+        ParsedRequest r("GET /a%3fb?c=%41&d#e HTTP/1.1\r\n\r\n");
+        CHECK(r.done());
+        CHECK(r.request.path == "/a?b");
+        CHECK(r.request.query == "c=%41&d");
+        CHECK(r.request.fragment == "e");
+    }
+
+    // absolute-form
+    CHECK(path_of("http://host/x?q") == "/x");
+    CHECK(path_of("HTTPS://host:8080/a/../b") == "/b");
+    CHECK(path_of("http://host") == "/");
+    CHECK(path_of("http://host?q") == "/");
+    CHECK(path_of("http:///x") == "<bad request>");
+    CHECK(path_of("ftp://host/x") == "<bad request>");
+    {
+        ParsedRequest r("GET http://host/x?q HTTP/1.1\r\n\r\n");
+        CHECK(r.done());
+        CHECK(r.request.query == "q");
+    }
+}
+
+static bool same_request(const HttpRequest& a, const HttpRequest& b) {
+    if (a.method != b.method || a.path != b.path || a.query != b.query || a.fragment != b.fragment) return false;
+    if (a.headers.size() != b.headers.size() || a.repeated_headers != b.repeated_headers) return false;
+    for (size_t i = 0; i < a.headers.size(); ++i) {
+        if (a.headers[i].id != b.headers[i].id || a.headers[i].name != b.headers[i].name || a.headers[i].value != b.headers[i].value) return false;
+    }
+    for (size_t i = 0; i < KNOWN_HTTP_HEADER_COUNT; ++i) {
+        if (a.known_headers[i] != b.known_headers[i] || a.has_header((HttpHeaderId)i) != b.has_header((HttpHeaderId)i)) return false;
+    }
+    return true;
+}
+
+// Parses the request with its bytes arriving in parts that end at the
+// given offsets. Every part but the last must need more, and the request
+// must come out the same as when it's parsed at once.
+static void check_resumed_parse(std::string_view text, const std::vector<size_t>& part_ends) {
+    using enum HttpRequestParser::ParseResult;
+    ParsedRequest whole(text);
+    CHECK(whole.done());
+
+    ParsedRequest r("");
+    CHECK(r.result == NEED_MORE);
+    memcpy(&r.parser.b[0], text.data(), text.size());
+    for (size_t i = 0; i < part_ends.size(); ++i) {
+        r.parser.end = part_ends[i];
+        r.result = r.parser.parse(r.request);
+        if (i + 1 < part_ends.size() && r.result != NEED_MORE) {
+            fmt::print(stderr, "Parsing {} of {} bytes didn't need more: {:?}\n", part_ends[i], text.size(), text);
+            CHECK(r.result == NEED_MORE);
+            return;
+        }
+    }
+    CHECK(r.done());
+    CHECK(same_request(r.request, whole.request));
+}
+
+static void check_byte_by_byte_parse(std::string_view text) {
+    std::vector<size_t> part_ends;
+    for (size_t i = 1; i <= text.size(); ++i) {
+        part_ends.push_back(i);
+    }
+    check_resumed_parse(text, part_ends);
+}
+
+static void test_resumed_parsing() {
+    const std::string_view request = "GET /a/./b%20c?q=1#f HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "X-Empty:\r\n"
+        "Accept: text/html, */*\r\n"
+        "Accept: image/png\r\n"
+        "If-None-Match:   \"abc\"  \r\n"
+        "\r\n";
+    check_byte_by_byte_parse(request);
+    check_byte_by_byte_parse("\r\nGET http://host HTTP/1.1\r\n\r\n");
+
+    // Split between the CR and the LF of the request line
+    const size_t line_end = request.find("\r\n");
+    check_resumed_parse(request, { line_end + 1, request.size() });
+    // Split inside a header name
+    const size_t name = request.find("Connection");
+    check_resumed_parse(request, { name + 4, request.size() });
+    // Split between the CR and the LF of the empty line
+    check_resumed_parse(request, { request.size() - 1, request.size() });
+    // Split inside the whitespace around a value
+    const size_t value = request.find("\"abc\"");
+    check_resumed_parse(request, { value - 1, value + 6, request.size() });
+}
+
+static void test_repeated_headers() {
+    {
+        ParsedRequest r("GET / HTTP/1.1\r\nHost: a\r\nHost: b\r\n\r\n");
+        CHECK(r.result == HttpRequestParser::ParseResult::BAD_REQUEST);
+    }
+    {
+        ParsedRequest r("GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n");
+        CHECK(r.result == HttpRequestParser::ParseResult::BAD_REQUEST);
+    }
+    {
+        // The lines of a list header are one list
+        ParsedRequest r("GET / HTTP/1.1\r\nConnection: keep-alive\r\nConnection: close\r\n\r\n");
+        CHECK(r.done());
+        CHECK(r.request.header(HttpHeaderId::CONNECTION) == "keep-alive");
+        CHECK(r.request.wants_connection_close());
+    }
+    {
+        ParsedRequest r("GET / HTTP/1.1\r\nConnection: keep-alive\r\n\r\n");
+        CHECK(r.done());
+        CHECK(!r.request.wants_connection_close());
+    }
+}
+
+static void test_empty_header_values() {
+    ParsedRequest r("GET / HTTP/1.1\r\nHost: x\r\nAccept:\r\nX-Empty:  \r\n\r\n");
+    CHECK(r.done());
+    CHECK(r.request.has_header(HttpHeaderId::ACCEPT));
+    CHECK(r.request.header(HttpHeaderId::ACCEPT).empty());
+    CHECK(!r.request.has_header(HttpHeaderId::COOKIE));
+    CHECK(r.request.find_header("accept") != nullptr);
+    CHECK(r.request.find_header("Cookie") == nullptr);
+
+    const auto* x_empty = r.request.find_header("x-empty");
+    CHECK(x_empty && x_empty->empty());
+}
+
+static ByteRanges ranges_of(std::string_view range, u64 size, HttpRequest::RangeResult expected_result = HttpRequest::RangeResult::PARTIAL) {
+    const auto text = fmt::format("GET /file HTTP/1.1\r\nRange: {}\r\n\r\n", range);
+    ParsedRequest r(text);
+    CHECK(r.done());
+
+    ByteRanges ranges;
+    const auto result = r.request.requested_ranges(size, "\"etag\"", std::chrono::system_clock::time_point(), ranges);
+    CHECK(result == expected_result);
+    return ranges;
+}
+
+static bool equal(const ByteRanges& ranges, std::initializer_list<ByteRange> expected) {
+    return std::equal(ranges.begin(), ranges.end(), expected.begin(), expected.end(), [](const ByteRange& a, const ByteRange& b) {
+        return a.first == b.first && a.length == b.length;
+    });
+}
+
+// Sun, 06 Nov 1994 08:49:37 GMT
+static const auto LAST_MODIFIED = std::chrono::system_clock::from_time_t(784111777);
+static constexpr std::string_view ETAG = "\"1a2b\"";
+
+static bool not_modified(std::string_view headers, std::string_view method = "GET", std::chrono::system_clock::time_point last_modified = LAST_MODIFIED) {
+    ParsedRequest r(fmt::format("{} / HTTP/1.1\r\n{}\r\n", method, headers));
+    CHECK(r.done());
+    return r.request.is_not_modified(ETAG, last_modified);
+}
+
+static void test_conditional_requests() {
+    CHECK(!not_modified(""));
+
+    // If-None-Match uses the weak comparison
+    CHECK(not_modified("If-None-Match: \"1a2b\"\r\n"));
+    CHECK(not_modified("If-None-Match: W/\"1a2b\"\r\n"));
+    CHECK(not_modified("If-None-Match: *\r\n"));
+    CHECK(!not_modified("If-None-Match: \"1a2c\"\r\n"));
+    CHECK(!not_modified("If-None-Match: 1a2b\r\n"));
+    CHECK(not_modified("If-None-Match: \"x\", W/\"1a2b\", \"y\"\r\n"));
+    CHECK(not_modified("If-None-Match: \"x\",\"1a2b\"\r\n"));
+    CHECK(!not_modified("If-None-Match: \"x\", \"y\"\r\n"));
+    CHECK(not_modified("If-None-Match: \"x\"\r\nIf-None-Match: \"1a2b\"\r\n"));
+
+    // If-Modified-Since
+    CHECK(not_modified("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"));
+    CHECK(not_modified("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", "GET", LAST_MODIFIED + std::chrono::milliseconds(500)));
+    CHECK(not_modified("If-Modified-Since: Mon, 07 Nov 1994 00:00:00 GMT\r\n"));
+    CHECK(not_modified("If-Modified-Since: Thu, 01 Jan 2065 00:00:00 GMT\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sun, 06 Nov 1994 08:49:36 GMT\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sat, 01 Jan 1994 00:00:00 GMT\r\n"));
+    // Invalid dates are ignored, and so are the obsolete formats
+    CHECK(!not_modified("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 UTC\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sun, 06 Nox 2094 08:49:37 GMT\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sun, 06 Nov 2094 08:4x:37 GMT\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sun, 00 Nov 2094 08:49:37 GMT\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sun,06 Nov 2094 08:49:37 GMT \r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sunday, 06-Nov-94 08:49:37 GMT\r\n"));
+    CHECK(!not_modified("If-Modified-Since: Sun Nov  6 08:49:37 1994\r\n"));
+    CHECK(!not_modified("If-Modified-Since: yesterday\r\n"));
+
+    // If-Modified-Since is ignored when If-None-Match is sent
+    CHECK(!not_modified("If-None-Match: \"x\"\r\nIf-Modified-Since: Thu, 01 Jan 2065 00:00:00 GMT\r\n"));
+    CHECK(not_modified("If-Modified-Since: Sat, 01 Jan 1994 00:00:00 GMT\r\nIf-None-Match: \"1a2b\"\r\n"));
+
+    // Only GET and HEAD can be answered with 304
+    CHECK(not_modified("If-None-Match: \"1a2b\"\r\n", "HEAD"));
+    CHECK(not_modified("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", "HEAD"));
+    CHECK(!not_modified("If-None-Match: \"1a2b\"\r\n", "POST"));
+    CHECK(!not_modified("If-None-Match: *\r\n", "PUT"));
+    CHECK(!not_modified("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", "DELETE"));
+}
+
+static void test_ranges() {
+    using enum HttpRequest::RangeResult;
+
+    CHECK(equal(ranges_of("bytes=0-9", 1000), { { 0, 10 } }));
+    CHECK(equal(ranges_of("bytes=-10", 1000), { { 990, 10 } }));
+    CHECK(equal(ranges_of("bytes=990-2000", 1000), { { 990, 10 } }));
+    CHECK(ranges_of("bytes=1000-", 1000, UNSATISFIABLE).empty());
+    CHECK(ranges_of("bytes=5-1", 1000, WHOLE).empty());
+
+    // Ranges that don't touch keep the order they were requested in
+    CHECK(equal(ranges_of("bytes=20-29,0-9", 1000), { { 20, 10 }, { 0, 10 } }));
+
+    // Overlapping and adjacent ranges are merged
+    CHECK(equal(ranges_of("bytes=0-9,5-19", 1000), { { 0, 20 } }));
+    CHECK(equal(ranges_of("bytes=10-19,0-9", 1000), { { 0, 20 } }));
+    CHECK(equal(ranges_of("bytes=50-59,0-9,5-14,-1", 1000), { { 0, 15 }, { 50, 10 }, { 999, 1 } }));
+
+    // The whole file asked for as many times as allowed is sent once
+    std::string repeated = "bytes=0-";
+    for (size_t i = 1; i < HttpRequest::MAX_RANGE_COUNT; ++i) {
+        repeated += ",0-";
+    }
+    CHECK(equal(ranges_of(repeated, 1000), { { 0, 1000 } }));
+}
+
+int main() {
+    test_framing();
+    test_malformed_header_lines();
+    test_request_targets();
+    test_resumed_parsing();
+    test_conditional_requests();
+    test_repeated_headers();
+    test_empty_header_values();
+    test_ranges();
+
+    if (failures) {
+        fmt::print(stderr, "{} checks failed\n", failures);
+        return 1;
+    }
+    fmt::print("All checks passed\n");
+    return 0;
+}